@@ -38,13 +38,34 @@
 #include <thread>
 #include <atomic>
 #include <unordered_map>
+#include <unordered_set>
+#include <list>
+#include <memory>
 #include <future>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+
+//SIMD
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define GIZEGO_SSE2
+#endif
 
 //WINDOWS
 #ifdef _WIN32
 #include <Windows.h>
 #endif
 
+//POSIX
+#if !defined(_WIN32) && (defined(__unix__) || defined(__APPLE__))
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define GIZEGO_MMAP
+#endif
+
 //OPENGL
 #include "glad/glad.h"
 #include "glfw/glfw3.h"
@@ -130,6 +151,13 @@ namespace GizegoEngine
 		inline Size(unsigned int width, unsigned int height) { this->width = width; this->height = height; }
 	};
 
+	//DO NOT USE. A vertex with a position, a texture coordinate and a color. This is what the engine meshes are built with.
+	struct ColorVertex
+	{
+		float x, y, u, v;
+		Color c;
+	};
+
 	//The random number generator
 	namespace Random
 	{
@@ -485,13 +513,20 @@ namespace GizegoEngine
 			//Saves a binary file
 			static void Save(std::wstring filepath, std::vector<unsigned char> data)
 			{
-				FILE* file = _wfopen(filepath.c_str(), L"w");
+				Save(filepath, data.data(), data.size());
+			}
+
+			//Saves size bytes to a binary file
+			static void Save(std::wstring filepath, const unsigned char* data, size_t size)
+			{
+				FILE* file = _wfopen(filepath.c_str(), L"wb");
 				if (file == NULL)
 					ThrowException(L"Error saving binary file " + filepath);
 				else
 				{
-					for (unsigned int i = 0; i < data.size(); ++i)
-						fputc(data[i], file);
+					if (fwrite(data, 1, size, file) != size)
+						ThrowException(L"Error saving binary file " + filepath);
+					fclose(file);
 				}
 			}
 
@@ -530,6 +565,117 @@ namespace GizegoEngine
 			unsigned long long m_length;
 		};
 
+		//A file mapped in memory. Writing to the data changes a private copy of the touched pages, never the file. On systems without windows.h nor mmap the file is read in memory instead.
+		class MappedFile
+		{
+		public:
+			inline MappedFile() {}
+			//It owns the mapping, so it can't be copied
+			MappedFile(const MappedFile&) = delete;
+			MappedFile& operator=(const MappedFile&) = delete;
+
+			MappedFile(std::wstring filepath)
+			{
+#ifdef _WINDOWS_
+				m_file = CreateFileW(filepath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+				if (m_file == INVALID_HANDLE_VALUE)
+				{
+					m_file = NULL;
+					ThrowException(L"Error opening mapped file " + filepath);
+					return;
+				}
+				LARGE_INTEGER size;
+				GetFileSizeEx(m_file, &size);
+				m_length = size.QuadPart;
+				if (m_length)
+				{
+					m_mapping = CreateFileMappingW(m_file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+					if (m_mapping)
+						m_data = (unsigned char*)MapViewOfFile(m_mapping, FILE_MAP_COPY, 0, 0, 0);
+					if (!m_data)
+					{
+						m_length = 0;
+						ThrowException(L"Error mapping file " + filepath);
+					}
+				}
+#elif defined(GIZEGO_MMAP)
+				int file = open(StringTools::ToString(filepath).c_str(), O_RDONLY);
+				if (file < 0)
+				{
+					ThrowException(L"Error opening mapped file " + filepath);
+					return;
+				}
+				struct stat info;
+				if (fstat(file, &info) == 0)
+					m_length = info.st_size;
+				if (m_length)
+				{
+					void* data = mmap(NULL, m_length, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+					if (data == MAP_FAILED)
+					{
+						m_length = 0;
+						ThrowException(L"Error mapping file " + filepath);
+					}
+					else
+						m_data = (unsigned char*)data;
+				}
+				//The mapping stays valid once the file is closed
+				close(file);
+#else
+				FILE* file = _wfopen(filepath.c_str(), L"rb");
+				if (file == NULL)
+				{
+					ThrowException(L"Error opening mapped file " + filepath);
+					return;
+				}
+				fseek(file, 0, SEEK_END);
+				m_length = (unsigned long long)ftell(file);
+				fseek(file, 0, SEEK_SET);
+				m_data = new unsigned char[m_length];
+				if (fread(m_data, 1, m_length, file) != m_length)
+				{
+					ThrowException(L"Error reading mapped file " + filepath);
+					m_length = 0;
+				}
+				fclose(file);
+#endif
+			}
+
+			~MappedFile()
+			{
+#ifdef _WINDOWS_
+				if (m_data)
+					UnmapViewOfFile(m_data);
+				if (m_mapping)
+					CloseHandle(m_mapping);
+				if (m_file)
+					CloseHandle(m_file);
+#elif defined(GIZEGO_MMAP)
+				if (m_data)
+					munmap(m_data, m_length);
+#else
+				if (m_data)
+					delete[] m_data;
+#endif
+			}
+
+			//Returns the content of the file.
+			inline unsigned char* GetData() { return m_data; }
+
+			//Returns the size of the file in bytes.
+			inline unsigned long long GetSize()
+			{
+				return m_length;
+			}
+
+		private:
+			unsigned char* m_data = NULL;
+			unsigned long long m_length = 0;
+#ifdef _WINDOWS_
+			HANDLE m_file = NULL, m_mapping = NULL;
+#endif
+		};
+
 		//Returns the list of files inside a directory.
 		std::vector<std::wstring> GetFilesInDirectory(std::wstring directory)
 		{
@@ -736,15 +882,15 @@ namespace GizegoEngine
 	//Namespace to get information about the system hardware.
 	namespace Hardware
 	{
-		//Returns the number of threads in the CPU.
+		//Returns the number of threads in the CPU, at least 1 even when it can't be detected.
 		inline unsigned int GetThreadCount()
 		{
 #ifdef _WINDOWS_
 			SYSTEM_INFO sysinfo;
 			GetSystemInfo(&sysinfo);
-			return sysinfo.dwNumberOfProcessors;
+			return std::max((unsigned int)sysinfo.dwNumberOfProcessors, 1u);
 #else
-			return std::thread::hardware_concurrency();
+			return std::max(std::thread::hardware_concurrency(), 1u);
 #endif
 		}
 
@@ -1598,13 +1744,40 @@ return T();
 			glLinkProgram(m_id);
 			glValidateProgram(m_id);
 
+			m_ortho = glGetUniformLocation(m_id, "ortho");
 			uniforms(m_id);
-			glUseProgram(m_id);
+			Use();
+
+		}
+
+		//Makes this the current program and gives it the latest projection.
+		inline void Use()
+		{
+			if (s_current != m_id)
+			{
+				glUseProgram(m_id);
+				s_current = m_id;
+			}
+			if (m_orthoversion != s_orthoversion)
+			{
+				glUniformMatrix4fv(m_ortho, 1, 0, s_ortho);
+				m_orthoversion = s_orthoversion;
+			}
+		}
 
+		//Sets the projection every shader will use. Each shader uploads it the next time it is used.
+		static void SetOrtho(float* matrix)
+		{
+			for (unsigned int i = 0; i < 16; i++)
+				s_ortho[i] = matrix[i];
+			s_orthoversion++;
 		}
 
 	private:
-		unsigned int m_vid, m_fid, m_id;
+		unsigned int m_vid, m_fid, m_id, m_orthoversion = 0;
+		int m_ortho;
+		static unsigned int s_current, s_orthoversion;
+		static float s_ortho[16];
 		static int Compile(const char* code, GLenum type)
 		{
 			unsigned int shaderID = glCreateShader(type);
@@ -1616,6 +1789,8 @@ return T();
 			return shaderID;
 		}
 	};
+	unsigned int Shader::s_current, Shader::s_orthoversion;
+	float Shader::s_ortho[16];
 	
 	//DO NOT USE.
 	enum ShaderType : char {Textured, ColorOnly};
@@ -1628,19 +1803,28 @@ return T();
 
 		inline void CreateUpLayer()
 		{
-			Create(VertexShader, FragShader, { ShaderVariable(0, "pos"), ShaderVariable(1, "tc") }, Uniforms);
+			Create(VertexShader, FragShader, { ShaderVariable(0, "pos"), ShaderVariable(1, "tc"), ShaderVariable(2, "col") }, Uniforms);
+			ResetVertexColor();
 			SetPosition(vec2());
 			SetScale(vecf(1, 1));
 			SetColor(Color(255, 255, 255));
 			SetShaderType(ShaderType::Textured);
-			
+			glUniform1i(m_light, 3);
+			SetLighting(0, 0, 0, 0, 0);
 		}
 
 		inline ~TextureShader() {}
 
 		inline void SetMatrix(float* matrix)
 		{
-			glUniformMatrix4fv(m_ortho, 1, 0, matrix);
+			SetOrtho(matrix);
+			Use();
+		}
+
+		//The other shaders call this after drawing because every renderer function expects this to be the current program.
+		inline void Use()
+		{
+			Shader::Use();
 		}
 
 		inline void SetPosition(vec2 pos)
@@ -1682,29 +1866,157 @@ return T();
 			}
 		}
 
+		//Multiplies what is drawn by a light texture bound to texture unit 3. offset turns screen positions into world pixels and scale turns world pixels into texture coordinates. Texture 0 turns lighting off.
+		inline void SetLighting(unsigned int texture, float x, float y, float sx, float sy)
+		{
+			glUniform1f(m_lit, texture ? 1.0f : 0.0f);
+			if (!texture)
+				return;
+			glUniform4f(m_lightarea, x, y, sx, sy);
+			glActiveTexture(GL_TEXTURE3);
+			glBindTexture(GL_TEXTURE_2D, texture);
+			glActiveTexture(GL_TEXTURE0);
+		}
+
+		//Meshes that carry a color per vertex leave the attribute undefined after drawing. This sets it back to white for the meshes that don't.
+		inline void ResetVertexColor()
+		{
+			glVertexAttrib4f(2, 1, 1, 1, 1);
+		}
+
 	private:
 		static const char *VertexShader, *FragShader;
-		static int m_ortho, m_position, m_scale, m_color, m_geo;
+		static int m_position, m_scale, m_color, m_geo, m_light, m_lightarea, m_lit;
 		int m_x, m_y; vecf l_scale; Color l_color; int l_geo;
 
 		static void Uniforms(int id)
 		{
-			m_ortho = glGetUniformLocation(id, "ortho");
 			m_position = glGetUniformLocation(id, "position");
 			m_scale = glGetUniformLocation(id, "scale");
 			m_color = glGetUniformLocation(id, "incolor");
 			m_geo = glGetUniformLocation(id, "geometric");
+			m_light = glGetUniformLocation(id, "light");
+			m_lightarea = glGetUniformLocation(id, "lightarea");
+			m_lit = glGetUniformLocation(id, "lit");
+		}
+	};
+	const char* TextureShader::VertexShader = "#version 130\nin vec2 pos;\nin vec2 tc;\nin vec4 col;\nout vec4 fragcolor;\nout vec2 outtc;\nout vec2 lighttc;\nout float geo;\nuniform mat4 ortho;\nuniform vec2 position;\nuniform vec2 scale;\nuniform vec4 incolor;\nuniform vec4 lightarea;\nuniform float geometric;\n"
+		"void main(void) {\n vec2 p = vec2(pos.x * scale.x, pos.y * scale.y) + position;\n gl_Position = ortho * vec4(p, 0.0, 1.0);\nfragcolor = incolor * col;\nouttc = tc;lighttc = (p + lightarea.xy) * lightarea.zw;geo = geometric;} "; 
+	const char* TextureShader::FragShader = "#version 130\nin vec4 fragcolor;\nin vec2 outtc;\nin vec2 lighttc;\nin float geo;\nuniform sampler2D txt;\nuniform sampler2D light;\nuniform float lit;\nvoid main(void) {\n vec4 l = lit == 0.0f ? vec4(1.0) : texture2D(light, lighttc);\n if (geo == 0.0f)\n\tgl_FragColor = texture2D(txt, outtc) * fragcolor * l;\nelse\n\tgl_FragColor = fragcolor * l; }";
+	int TextureShader::m_position, TextureShader::m_scale, TextureShader::m_color, TextureShader::m_geo, TextureShader::m_light, TextureShader::m_lightarea, TextureShader::m_lit;
+
+	//DO NOT USE. This is directly related to OpenGL and this is automatically used by the renderer. Draws a terrain layer as one quad that looks tiles up in a tile id texture.
+	class TileMapShader : Shader
+	{
+	public:
+		TileMapShader() {}
+
+		inline void CreateUpLayer()
+		{
+			Create(VertexShader, FragShader, { ShaderVariable(0, "pos") }, Uniforms);
+			glUniform1i(m_atlas, 0);
+			glUniform1i(m_ids, 1);
+			glUniform1i(m_lut, 2);
+			glUniform1i(m_light, 3);
+		}
+
+		inline ~TileMapShader() {}
+
+		inline void Use()
+		{
+			Shader::Use();
+		}
+
+		//Sets the screen rectangle covered by the quad and the camera position in pixels.
+		inline void SetArea(vec2 pos, Size size, vec2 camera)
+		{
+			glUniform2f(m_offset, (float)pos.x, (float)pos.y);
+			glUniform2f(m_area, (float)size.width, (float)size.height);
+			glUniform2f(m_camera, (float)camera.x, (float)camera.y);
+		}
+
+		//Sets the tile size in pixels, the size of the atlas texture, the size of the terrain and the number of tiles in the atlas.
+		inline void SetMap(unsigned int tilesize, Size atlas, Size terrain, unsigned int tiles)
+		{
+			glUniform1f(m_tilesize, (float)tilesize);
+			glUniform2f(m_atlassize, (float)atlas.width, (float)atlas.height);
+			glUniform2i(m_mapsize, terrain.width, terrain.height);
+			glUniform1ui(m_tiles, tiles);
+		}
+
+	private:
+		static const char *VertexShader, *FragShader;
+		static int m_offset, m_area, m_camera, m_tilesize, m_atlassize, m_mapsize, m_tiles, m_atlas, m_ids, m_lut, m_light;
+
+		static void Uniforms(int id)
+		{
+			m_offset = glGetUniformLocation(id, "offset");
+			m_area = glGetUniformLocation(id, "area");
+			m_camera = glGetUniformLocation(id, "camera");
+			m_tilesize = glGetUniformLocation(id, "tilesize");
+			m_atlassize = glGetUniformLocation(id, "atlassize");
+			m_mapsize = glGetUniformLocation(id, "mapsize");
+			m_tiles = glGetUniformLocation(id, "tiles");
+			m_atlas = glGetUniformLocation(id, "atlas");
+			m_ids = glGetUniformLocation(id, "ids");
+			m_lut = glGetUniformLocation(id, "lut");
+			m_light = glGetUniformLocation(id, "light");
+		}
+	};
+	const char* TileMapShader::VertexShader = "#version 130\nin vec2 pos;\nout vec2 world;\nuniform mat4 ortho;\nuniform vec2 offset;\nuniform vec2 area;\nuniform vec2 camera;\n"
+		"void main(void) {\n vec2 p = offset + pos * area;\n gl_Position = ortho * vec4(p, 0.0, 1.0);\n world = p + camera; }";
+	const char* TileMapShader::FragShader = "#version 130\nin vec2 world;\nuniform sampler2D atlas;\nuniform usampler2D ids;\nuniform usampler2D lut;\nuniform sampler2D light;\nuniform float tilesize;\nuniform vec2 atlassize;\nuniform ivec2 mapsize;\nuniform uint tiles;\n"
+		"void main(void) {\n ivec2 cell = ivec2(floor(world / tilesize));\n if (cell.x < 0 || cell.y < 0 || cell.x >= mapsize.x || cell.y >= mapsize.y)\n\tdiscard;\n uint id = texelFetch(ids, cell, 0).r;\n if (id >= tiles)\n\tdiscard;\n"
+		" vec2 at = vec2(texelFetch(lut, ivec2(int(id), 0), 0).rg);\n vec2 uv = (at * tilesize + world - vec2(cell) * tilesize) / atlassize;\n gl_FragColor = texture2D(atlas, uv) * texture2D(light, world / (tilesize * vec2(mapsize))); }";
+	int TileMapShader::m_offset, TileMapShader::m_area, TileMapShader::m_camera, TileMapShader::m_tilesize, TileMapShader::m_atlassize, TileMapShader::m_mapsize, TileMapShader::m_tiles,
+		TileMapShader::m_atlas, TileMapShader::m_ids, TileMapShader::m_lut, TileMapShader::m_light;
+	
+	//DO NOT USE. This is directly related to OpenGL and this is automatically used by the renderer. Draws many copies of a quad in one call, with a position, a scale and a color per instance.
+	class InstanceShader : Shader
+	{
+	public:
+		InstanceShader() {}
+
+		inline void CreateUpLayer()
+		{
+			Create(VertexShader, FragShader, { ShaderVariable(0, "pos"), ShaderVariable(3, "ipos"), ShaderVariable(4, "iscale"), ShaderVariable(5, "icol") }, Uniforms);
+		}
+
+		inline ~InstanceShader() {}
+
+		inline void Use()
+		{
+			Shader::Use();
+		}
+
+		//Sets the size in pixels of the quad before scaling and if it is textured.
+		inline void SetQuad(Size size, ShaderType type)
+		{
+			glUniform2f(m_size, (float)size.width, (float)size.height);
+			glUniform1f(m_geo, type);
+		}
+
+	private:
+		static const char *VertexShader, *FragShader;
+		static int m_size, m_geo;
+
+		static void Uniforms(int id)
+		{
+			m_size = glGetUniformLocation(id, "size");
+			m_geo = glGetUniformLocation(id, "geometric");
 		}
 	};
-	const char* TextureShader::VertexShader = "#version 130\nin vec2 pos;\nin vec2 tc;\nout vec4 fragcolor;\nout vec2 outtc;\nout float geo;\nuniform mat4 ortho;\nuniform vec2 position;\nuniform vec2 scale;\nuniform vec4 incolor;\nuniform float geometric;\n"
-		"void main(void) {\n gl_Position = ortho * vec4(vec2(pos.x * scale.x, pos.y * scale.y) + position, 0.0, 1.0);\nfragcolor = incolor;\nouttc = tc;geo = geometric;} "; 
-	const char* TextureShader::FragShader = "#version 130\nin vec4 fragcolor;\nin vec2 outtc;\nin float geo;\nuniform sampler2D txt;\nvoid main(void) {\n if (geo == 0.0f)\n\tgl_FragColor = texture2D(txt, outtc) * fragcolor;\nelse\n\tgl_FragColor = fragcolor; }";
-	int TextureShader::m_ortho, TextureShader::m_position, TextureShader::m_scale, TextureShader::m_color, TextureShader::m_geo;
+	const char* InstanceShader::VertexShader = "#version 130\nin vec2 pos;\nin vec2 ipos;\nin vec2 iscale;\nin vec4 icol;\nout vec4 fragcolor;\nout vec2 outtc;\nuniform mat4 ortho;\nuniform vec2 size;\n"
+		"void main(void) {\n gl_Position = ortho * vec4(pos * size * iscale + ipos, 0.0, 1.0);\nfragcolor = icol;\nouttc = pos;} ";
+	const char* InstanceShader::FragShader = "#version 130\nin vec4 fragcolor;\nin vec2 outtc;\nuniform float geometric;\nuniform sampler2D txt;\nvoid main(void) {\n if (geometric == 0.0f)\n\tgl_FragColor = texture2D(txt, outtc) * fragcolor;\nelse\n\tgl_FragColor = fragcolor; }";
+	int InstanceShader::m_size, InstanceShader::m_geo;
 	
 	//DO NOT USE. This is a list of all the shaders the engine uses.
 	namespace Shaders
 	{
 		TextureShader* ts;
+		TileMapShader* tm;
+		InstanceShader* is = NULL;
 	}
 	
 	//DO NOT USE. This is OpenGL directly related.
@@ -1713,6 +2025,18 @@ return T();
 		//DO NOT USE. This is OpenGL directly related.
 		unsigned int s_vao = 0, s_tex = 0, s_fbo = 0;
 
+		//DO NOT USE. True once Window::Create() made an OpenGL context. Without it, the resources only keep their pixels for the SoftwareRenderer.
+		bool s_context = false;
+
+		//DO NOT USE. Draws the quads waiting in the sprite batch. Call this before drawing anything that doesn't go through the batch.
+		void FlushBatch();
+
+		//DO NOT USE. Turns off the lighting of the renderers lit by a terrain or seen through a camera that is being deleted.
+		void ForgetLighting(const void* object);
+
+		//DO NOT USE. Draws what the software renderers recorded with an image or a mesh that is being deleted.
+		void FlushSoftware(const void* object);
+
 		//DO NOT USE. This is OpenGL directly related.
 		inline void BindTexture(unsigned int tex)
 		{
@@ -1742,6 +2066,7 @@ return T();
 		{
 			if (fbo != s_fbo)
 			{
+				FlushBatch();
 				s_fbo = fbo;
 				glBindFramebuffer(GL_FRAMEBUFFER, fbo);
 				glViewport(0, 0, width, height);
@@ -1756,6 +2081,253 @@ return T();
 		}
 	}
 
+	//DO NOT USE. This is automatically used by the renderer when deferred rendering is enabled.
+	namespace Queueing
+	{
+		//DO NOT USE. True while the renderers record their draws instead of drawing them.
+		bool s_recording = false;
+
+		//DO NOT USE. Records a quad for the renderer that was bound last.
+		void RecordQuad(unsigned int tex, float x, float y, float w, float h, float u1, float v1, float u2, float v2, Color color);
+		//DO NOT USE. Draws every recorded command.
+		void Submit();
+	}
+
+	//DO NOT USE. This is automatically used by the renderer. Collects the quads of images, sprites, text and particles in a streaming vertex buffer and draws them with one call per texture.
+	class SpriteBatch
+	{
+	public:
+		//The number of quads that fit in the vertex buffer. The batch is drawn when it gets full.
+		static const unsigned int MaxQuads = 4096;
+
+		SpriteBatch()
+		{
+			m_vertices = std::vector<ColorVertex>(MaxQuads * 4);
+
+			glGenVertexArrays(1, &m_vao);
+			m_ibo = CreateQuadIndices(MaxQuads, m_vao);
+			glGenBuffers(1, &m_vbo);
+			glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
+			glBufferData(GL_ARRAY_BUFFER, sizeof(ColorVertex) * MaxQuads * 4, NULL, GL_STREAM_DRAW);
+			glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(ColorVertex), (void*)0);
+			glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(ColorVertex), (void*)(sizeof(float) * 2));
+			glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(ColorVertex), (void*)(sizeof(float) * 4));
+			glEnableVertexAttribArray(2);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+		}
+
+		~SpriteBatch()
+		{
+			glDeleteVertexArrays(1, &m_vao);
+			glDeleteBuffers(1, &m_vbo);
+			glDeleteBuffers(1, &m_ibo);
+		}
+
+		//DO NOT USE. Queues a quad. Texture 0 draws the quad with its color only. The batch is drawn first if the texture changes.
+		inline void Add(unsigned int tex, float x, float y, float w, float h, float u1, float v1, float u2, float v2, Color color)
+		{
+			if (Queueing::s_recording)
+			{
+				Queueing::RecordQuad(tex, x, y, w, h, u1, v1, u2, v2, color);
+				return;
+			}
+
+			if ((m_count && tex != m_tex) || m_count == MaxQuads)
+				Flush();
+			m_tex = tex;
+
+			ColorVertex* v = &m_vertices[m_count * 4];
+			v[0] = { x, y, u1, v1, color };
+			v[1] = { x + w, y, u2, v1, color };
+			v[2] = { x + w, y + h, u2, v2, color };
+			v[3] = { x, y + h, u1, v2, color };
+			m_count++;
+		}
+
+		//DO NOT USE. Draws every queued quad.
+		void Flush()
+		{
+			if (!m_count)
+				return;
+			unsigned int count = m_count;
+			m_count = 0;
+
+			Shaders::ts->SetShaderType(m_tex ? ShaderType::Textured : ShaderType::ColorOnly);
+			Shaders::ts->SetPosition(vec2());
+			Shaders::ts->SetScale(vecf(1, 1));
+			Shaders::ts->SetColor(Color(255, 255, 255));
+			if (m_tex)
+				Bindings::BindTexture(m_tex);
+			Bindings::BindVAO(m_vao);
+
+			//Orphaning the buffer lets the driver hand a fresh one instead of waiting for the last draw
+			glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
+			glBufferData(GL_ARRAY_BUFFER, sizeof(ColorVertex) * MaxQuads * 4, NULL, GL_STREAM_DRAW);
+			glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(ColorVertex) * count * 4, m_vertices.data());
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+			glDrawElements(GL_TRIANGLES, count * 6, GL_UNSIGNED_SHORT, NULL);
+			Shaders::ts->ResetVertexColor();
+		}
+
+		//DO NOT USE. Creates an element buffer that draws quads made of 4 consecutive vertices as 2 triangles. It is attached to the given vertex array, so leave it to 0 unless the buffer belongs to it.
+		static unsigned int CreateQuadIndices(unsigned int quads, unsigned int vao = 0)
+		{
+			std::vector<unsigned short> indices;
+			indices.reserve(quads * 6);
+			for (unsigned int i = 0; i < quads; i++)
+			{
+				unsigned short b = i * 4;
+				indices.insert(indices.end(), { b, (unsigned short)(b + 2), (unsigned short)(b + 1), b, (unsigned short)(b + 2), (unsigned short)(b + 3) });
+			}
+			unsigned int ibo;
+			glGenBuffers(1, &ibo);
+			//The element buffer binding is part of the vertex array, binding it under the sprite batch's would replace its indices
+			Bindings::BindVAO(vao);
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+			glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned short), indices.data(), GL_STATIC_DRAW);
+			return ibo;
+		}
+
+	private:
+		std::vector<ColorVertex> m_vertices;
+		unsigned int m_vao, m_vbo, m_ibo, m_tex = 0, m_count = 0;
+	};
+
+	//DO NOT USE. The instanced drawing functions. They aren't part of OpenGL 3.0 so they are loaded when the driver has them.
+	namespace Instancing
+	{
+		typedef void (APIENTRYP DrawArraysInstancedProc)(GLenum mode, GLint first, GLsizei count, GLsizei instances);
+		typedef void (APIENTRYP VertexAttribDivisorProc)(GLuint index, GLuint divisor);
+
+		DrawArraysInstancedProc DrawArraysInstanced = NULL;
+		VertexAttribDivisorProc VertexAttribDivisor = NULL;
+
+		//DO NOT USE. Checks if the context has an extension.
+		inline bool HasExtension(const char* name)
+		{
+			//Before OpenGL 3.0 the extensions are one string separated by spaces
+			if (!glGetStringi)
+			{
+				const char* list = (const char*)glGetString(GL_EXTENSIONS);
+				size_t length = strlen(name);
+				for (const char* at = list ? strstr(list, name) : NULL; at; at = strstr(at + length, name))
+					if ((at == list || at[-1] == ' ') && (at[length] == ' ' || at[length] == 0))
+						return true;
+				return false;
+			}
+			int count = 0;
+			glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+			for (int i = 0; i < count; i++)
+				if (!strcmp((const char*)glGetStringi(GL_EXTENSIONS, i), name))
+					return true;
+			return false;
+		}
+
+		//DO NOT USE. Called in Window::Create(). The version is the one glad read from GL_VERSION, older contexts can't be asked for GL_MAJOR_VERSION. The ARB functions are used when the core ones are missing.
+		inline void Load()
+		{
+			int maj = ::GLVersion.major, min = ::GLVersion.minor;
+
+			if (maj > 3 || (maj == 3 && min >= 1))
+				DrawArraysInstanced = (DrawArraysInstancedProc)glfwGetProcAddress("glDrawArraysInstanced");
+			if (!DrawArraysInstanced && HasExtension("GL_ARB_draw_instanced"))
+				DrawArraysInstanced = (DrawArraysInstancedProc)glfwGetProcAddress("glDrawArraysInstancedARB");
+
+			if (maj > 3 || (maj == 3 && min >= 3))
+				VertexAttribDivisor = (VertexAttribDivisorProc)glfwGetProcAddress("glVertexAttribDivisor");
+			if (!VertexAttribDivisor && HasExtension("GL_ARB_instanced_arrays"))
+				VertexAttribDivisor = (VertexAttribDivisorProc)glfwGetProcAddress("glVertexAttribDivisorARB");
+		}
+
+		//Checks if particles can be drawn with instancing. If not, they go through the sprite batch.
+		inline bool IsSupported()
+		{
+			return DrawArraysInstanced && VertexAttribDivisor;
+		}
+	}
+
+	//DO NOT USE. The data of one instance drawn by the instance batch.
+	struct InstanceVertex
+	{
+		float x, y, sx, sy;
+		Color c;
+	};
+
+	//DO NOT USE. This is automatically used by the renderer. Draws a list of copies of the same quad in one instanced draw call.
+	class InstanceBatch
+	{
+	public:
+		InstanceBatch()
+		{
+			float quad[12] = { 0, 0, 1, 1, 1, 0, 0, 0, 1, 1, 0, 1 };
+
+			glGenVertexArrays(1, &m_vao);
+			Bindings::BindVAO(m_vao);
+			glGenBuffers(1, &m_quad);
+			glBindBuffer(GL_ARRAY_BUFFER, m_quad);
+			glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+			glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 2, NULL);
+			glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 2, NULL);
+
+			glGenBuffers(1, &m_vbo);
+			glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
+			glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(InstanceVertex), (void*)0);
+			glVertexAttribPointer(4, 2, GL_FLOAT, GL_FALSE, sizeof(InstanceVertex), (void*)(sizeof(float) * 2));
+			glVertexAttribPointer(5, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(InstanceVertex), (void*)(sizeof(float) * 4));
+			for (unsigned int i = 3; i < 6; i++)
+			{
+				glEnableVertexAttribArray(i);
+				Instancing::VertexAttribDivisor(i, 1);
+			}
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+		}
+
+		~InstanceBatch()
+		{
+			glDeleteVertexArrays(1, &m_vao);
+			glDeleteBuffers(1, &m_quad);
+			glDeleteBuffers(1, &m_vbo);
+		}
+
+		//DO NOT USE. Draws a quad of size pixels for every instance. Texture 0 draws the quads with their color only.
+		void Draw(unsigned int tex, Size size, const std::vector<InstanceVertex>& instances)
+		{
+			if (instances.empty())
+				return;
+			Bindings::FlushBatch();
+
+			Shaders::is->Use();
+			Shaders::is->SetQuad(size, tex ? ShaderType::Textured : ShaderType::ColorOnly);
+			if (tex)
+				Bindings::BindTexture(tex);
+			Bindings::BindVAO(m_vao);
+
+			//A new buffer every draw so the driver doesn't wait for the last one
+			glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
+			glBufferData(GL_ARRAY_BUFFER, sizeof(InstanceVertex) * instances.size(), instances.data(), GL_STREAM_DRAW);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+			Instancing::DrawArraysInstanced(GL_TRIANGLES, 0, 6, instances.size());
+			Shaders::ts->Use();
+		}
+
+	private:
+		unsigned int m_vao, m_quad, m_vbo;
+	};
+
+	//DO NOT USE. The batch every renderer draws its quads with.
+	namespace Batching
+	{
+		SpriteBatch* sb;
+		InstanceBatch* ib = NULL;
+	}
+
+	void Bindings::FlushBatch()
+	{
+		Queueing::Submit();
+		if (Batching::sb)
+			Batching::sb->Flush();
+	}
+
 	//BMP, PNG, JPEG or TGA
 	enum ImageFormat : char
 	{
@@ -1911,46 +2483,15 @@ return T();
 		}
 
 		//An image must be finalized before it can be rendered. This must be done after the window creation. Trying to edit an image or set it as an icon after finalization will crash the program.
-		void Finalize()
+		//Set retain to keep the pixels so the image can also be drawn by a SoftwareRenderer. Without a window, the image keeps its pixels and has no texture.
+		void Finalize(bool retain = false)
 		{
-			HALF_VERT vecs[12] = 
-			{
-				0, 0,
-				(int)m_width, (int)m_height,
-				(int)m_width, 0,
-				0, 0,
-				(int)m_width, (int)m_height,
-				0, (int) m_height
-			};
-
-			float tcs[12] = { 
-				0, 0,
-				1, 1,
-				1, 0,
-				0, 0,
-				1, 1,
-				0, 1
-			};
-
-			//VAO
-			glGenVertexArrays(1, &m_vao);
-			Bind();
-
-			//VBO
-			glGenBuffers(1, &m_vbo);
-			glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-			glBufferData(GL_ARRAY_BUFFER, sizeof(vecs), vecs, GL_STATIC_DRAW);
-			glVertexAttribPointer(0, 2, VERTEX_TYPE, GL_FALSE, sizeof(int) * 2, NULL);		
-
-			//TBO
-			glGenBuffers(1, &m_tbo);
-			glBindBuffer(GL_ARRAY_BUFFER, m_tbo);
-			glBufferData(GL_ARRAY_BUFFER, sizeof(tcs), tcs, GL_STATIC_DRAW);
-			glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 2, NULL);
+			if (!Bindings::s_context)
+				return;
 
 			//TEXTURE
 			glGenTextures(1 ,&m_tex);
-			Bind();
+			Bindings::BindTexture(m_tex);
 			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
@@ -1958,41 +2499,39 @@ return T();
 			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, m_width, m_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, m_data);
 
 			//DELETING OLD IMAGE
-			stbi_image_free(m_data);
-			m_data = NULL;
-			glBindBuffer(GL_ARRAY_BUFFER, 0);
+			if (!retain)
+			{
+				stbi_image_free(m_data);
+				m_data = NULL;
+			}
 		}
 
 		//Renders the image to the current framebuffer. DO NOT USE.
-		inline void Render()
+		inline void Render(vec2 pos, vecf scale, Color color)
 		{
-			Bind();
-			glDrawArrays(GL_TRIANGLES, 0, 12);
+			Batching::sb->Add(m_tex, pos.x, pos.y, m_width * scale.x, m_height * scale.y, 0, 0, 1, 1, color);
+		}
+
+		//DO NOT USE. Returns the OpenGL texture of a finalized image.
+		inline unsigned int GetTexture()
+		{
+			return m_tex;
 		}
 
 		~Image() {
+			Bindings::FlushSoftware(this);
+			if (m_tex)
+				Bindings::FlushBatch();
 			if (m_data)
 				free(m_data);
-			if (m_vao)
-				glDeleteVertexArrays(1, &m_vao);
-			if (m_vbo)
-				glDeleteBuffers(1, &m_vbo);
-			if (m_tbo)
-				glDeleteBuffers(1, &m_tbo);
 			if (m_tex)
 				glDeleteTextures(1, &m_tex);
 		}
 
 	private:
-		unsigned char* m_data;
+		unsigned char* m_data = NULL;
 		unsigned int m_width, m_height;
-		unsigned int m_vao = 0, m_vbo = 0, m_tbo = 0, m_tex = 0;	
-
-		inline void Bind()
-		{
-			Bindings::BindTexture(m_tex);
-			Bindings::BindVAO(m_vao);
-		}
+		unsigned int m_tex = 0;	
 	};
 	
 	//FillTriangles (Fill) or Lines (outline)
@@ -2013,6 +2552,9 @@ return T();
 		GeometryMesh(std::vector<HALF_VERT> vecs)
 		{
 			m_count = vecs.size();
+			m_points = vecs;
+			if (!Bindings::s_context)
+				return;
 			glGenVertexArrays(1, &m_vao);
 			Bindings::BindVAO(m_vao);
 
@@ -2043,6 +2585,9 @@ return T();
 			vecs.push_back(0);
 
 			m_count = vecs.size();
+			m_points = vecs;
+			if (!Bindings::s_context)
+				return;
 			glGenVertexArrays(1, &m_vao);
 			Bindings::BindVAO(m_vao);
 
@@ -2053,6 +2598,18 @@ return T();
 			glBindBuffer(GL_ARRAY_BUFFER, 0);
 		}
 
+		//DO NOT USE. Returns the OpenGL vertex array of the mesh.
+		inline unsigned int GetVAO()
+		{
+			return m_vao;
+		}
+
+		//DO NOT USE. Returns the x and y of every vertex.
+		inline const std::vector<HALF_VERT>& GetPoints()
+		{
+			return m_points;
+		}
+
 		//DO NOT USE.
 		void Render(GeometryRenderingMode mode, int offsetx, int offsety)
 		{
@@ -2071,36 +2628,31 @@ return T();
 
 		~GeometryMesh()
 		{
+			Bindings::FlushSoftware(this);
 			if (m_vao)
+			{
+				Bindings::FlushBatch();
 				glDeleteVertexArrays(1 ,&m_vao);
+			}
 			if (m_vbo)
 				glDeleteBuffers(1, &m_vbo);
 		}
 
 	private:
 		unsigned int m_vao = 0, m_vbo = 0, m_count = 0, m_rad;
+		std::vector<HALF_VERT> m_points;
 	};
 	
 	class Font
 	{
 		struct Glyph
 		{
-			unsigned int x, y, w, h, adv, vao, vbo, tbo;
-
-			void Destroy()
-			{
-				if (vao)
-				{
-					glDeleteVertexArrays(1, &vao);
-					glDeleteBuffers(1, &vbo);
-					glDeleteBuffers(1, &tbo);
-				}
-			}
+			unsigned int x, y, w, h, adv, xoff;
 		};
 	public:
 		inline Font() {}
-		//Only call this constructor after Window::Create().
-		Font(std::wstring filepath, unsigned int size, int range)
+		//Only call this constructor after Window::Create(). Set retain to keep the glyph pixels so the font can also be drawn by a SoftwareRenderer. Without a window, they are always kept.
+		Font(std::wstring filepath, unsigned int size, int range, bool retain = false)
 		{
 			m_size = size;
 			m_file = new IO::BinaryFile(filepath);
@@ -2136,6 +2688,8 @@ return T();
 			}
 			
 			m_max = th;
+			m_tw = tw;
+			m_th = th;
 
 			Image* atlas = new Image(Size(tw, th));
 			int xoff = 0;
@@ -2147,41 +2701,13 @@ return T();
 					atlas->SetPixel(vec2(b % m_glyphs[i].w + xoff, b / m_glyphs[i].w), Color(img[b], img[b], img[b], img[b]));
 
 				delete[] img;
-				
-				glGenVertexArrays(1, &m_glyphs[i].vao);
-				Bindings::BindVAO(m_glyphs[i].vao);
-
-				HALF_VERT vecs[] = {
-					0, 0,
-					m_glyphs[i].w, m_glyphs[i].h,
-					m_glyphs[i].w, 0,
-					0, 0,
-					m_glyphs[i].w, m_glyphs[i].h,
-					0, m_glyphs[i].h,
-				};
-
-				float tcs[] = {
-					(float)xoff / tw, 0,
-					(float)(xoff + m_glyphs[i].w) / tw, (float)m_glyphs[i].h / th,
-					(float)(xoff + m_glyphs[i].w) / tw, 0,
-					(float)xoff / tw, 0,
-					(float)(xoff + m_glyphs[i].w) / tw, (float)m_glyphs[i].h / th,
-					(float)xoff / tw, (float)m_glyphs[i].h / th
-				};
-
-				glGenBuffers(1, &m_glyphs[i].vbo);
-				glBindBuffer(GL_ARRAY_BUFFER, m_glyphs[i].vbo);
-				glBufferData(GL_ARRAY_BUFFER, sizeof(vecs), vecs, GL_STATIC_DRAW);
-				glVertexAttribPointer(0, 2, VERTEX_TYPE, GL_FALSE, sizeof(int) * 2, NULL);
-
-				glGenBuffers(1, &m_glyphs[i].tbo);
-				glBindBuffer(GL_ARRAY_BUFFER, m_glyphs[i].tbo);
-				glBufferData(GL_ARRAY_BUFFER, sizeof(tcs), tcs, GL_STATIC_DRAW);
-				glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 2, NULL);
-
-				glBindBuffer(GL_ARRAY_BUFFER, 0);
+				m_glyphs[i].xoff = xoff;
 				xoff += m_glyphs[i].w;
 			}		
+			if (retain || !Bindings::s_context)
+				m_pixels = atlas;
+			if (!Bindings::s_context)
+				return;
 			glGenTextures(1, &m_tex);
 			Bindings::BindTexture(m_tex);
 			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
@@ -2189,11 +2715,12 @@ return T();
 			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, atlas->GetWidth(), atlas->GetHeight(), 0, GL_RGBA, GL_UNSIGNED_BYTE, atlas->GetData());
-			delete atlas;
+			if (!m_pixels)
+				delete atlas;
 		}
 
 		//DO NOT USE.
-		vec2 RenderGlyph(wchar_t character, int x, int y)
+		vec2 RenderGlyph(wchar_t character, int x, int y, Color color)
 		{
 			if (character == L'\n')
 				return vec2(-x, m_max);
@@ -2201,11 +2728,9 @@ return T();
 			if (character == L'\t')
 				return vec2(m_glyphs[9].adv, 0);
 
-			Bindings::BindTexture(m_tex);
-			Shaders::ts->SetPosition(vec2(x + m_glyphs[character].x, m_max + m_glyphs[character].y + y));
-			Bindings::BindVAO(m_glyphs[character].vao);
-			glDrawArrays(GL_TRIANGLES, 0, 12);
-			return vec2(m_glyphs[character].adv, 0);
+			Glyph& g = m_glyphs[character];
+			Batching::sb->Add(m_tex, (float)(x + (int)g.x), (float)(m_max + (int)g.y + y), g.w, g.h, (float)g.xoff / m_tw, 0, (float)(g.xoff + g.w) / m_tw, (float)g.h / m_th, color);
+			return vec2(g.adv, 0);
 		}
 
 		//DO NOT USE.
@@ -2238,8 +2763,9 @@ return T();
 		}
 
 		~Font() {
-			for (int i = 0; i < m_glyphs.size(); i++)
-				m_glyphs[i].Destroy();
+			Bindings::FlushBatch();
+			if (m_pixels)
+				delete m_pixels;
 			if (m_file)
 				delete m_file;
 			if (m_tex)
@@ -2252,7 +2778,10 @@ return T();
 	private:
 		std::vector<Glyph> m_glyphs;
 		IO::BinaryFile* m_file;
-		unsigned int m_tex, m_size, m_max;
+		unsigned int m_tex = 0, m_size, m_max, m_tw, m_th;
+		Image* m_pixels = NULL;
+
+		friend class SoftwareRenderer;
 	};
 	
 	//Represents a square particle. It can be instanced with a ParticleInstance.
@@ -2265,7 +2794,8 @@ return T();
 		inline ParticleCore(Image* img)
 		{
 			m_textured = true;
-			CreateBuffers(img->GetWidth(), img->GetHeight());
+			m_width = img->GetWidth();
+			m_height = img->GetHeight();
 			CreateTexture(img);
 		}
 
@@ -2273,79 +2803,39 @@ return T();
 		inline ParticleCore(unsigned int width, unsigned int height)
 		{
 			m_textured = false;
-			CreateBuffers(width, height);
+			m_width = width;
+			m_height = height;
 		}
 
 		~ParticleCore() 
 		{
-			if (m_vao)
-				glDeleteVertexArrays(1, &m_vao);
-			if (m_vbo)
-				glDeleteBuffers(1, &m_vbo);
-			if (m_tbo)
-				glDeleteBuffers(1, &m_tbo);
+			Bindings::FlushBatch();
 			if (m_tex)
 				glDeleteTextures(1, &m_tex);
 		}
 
-		//DO NOT USE.
-		void RenderCore()
+		//DO NOT USE. Returns the texture of the particles or 0 if they only have a color.
+		inline unsigned int GetTexture()
 		{
-			Bindings::BindVAO(m_vao);
-			if (m_textured)
-			{ 
-				Shaders::ts->SetShaderType(ShaderType::Textured);
-				Bindings::BindTexture(m_tex);
-			}
-			else
-				Shaders::ts->SetShaderType(ShaderType::ColorOnly);
+			return m_textured ? m_tex : 0;
 		}
 
-	private:
-
-		void CreateBuffers(unsigned int width, unsigned int height)
+		//Returns the size of the particles in pixels before scaling.
+		inline Size GetSize()
 		{
-			HALF_VERT vecs[12] =
-			{
-				0, 0,
-				(int)width, (int)height,
-				(int)width, 0,
-				0, 0,
-				(int)width, (int)height,
-				0, (int)height
-			};
-
-			//VAO
-			glGenVertexArrays(1, &m_vao);
-			Bindings::BindVAO(m_vao);
-
-			//VBO
-			glGenBuffers(1, &m_vbo);
-			glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-			glBufferData(GL_ARRAY_BUFFER, sizeof(vecs), vecs, GL_STATIC_DRAW);
-			glVertexAttribPointer(0, 2, VERTEX_TYPE, GL_FALSE, sizeof(int) * 2, NULL);
-
-			glBindBuffer(GL_ARRAY_BUFFER, 0);
+			return Size(m_width, m_height);
 		}
 
-		void CreateTexture(Image* img)
+		//DO NOT USE. Queues a particle of this core in the sprite batch.
+		inline void Render(vec2 pos, vecf scale, Color color)
 		{
-			float tcs[12] = {
-				0, 0,
-				1, 1,
-				1, 0,
-				0, 0,
-				1, 1,
-				0, 1
-			};
+			Batching::sb->Add(m_textured ? m_tex : 0, pos.x, pos.y, m_width * scale.x, m_height * scale.y, 0, 0, 1, 1, color);
+		}
 
-			//TBO
-			glGenBuffers(1, &m_tbo);
-			glBindBuffer(GL_ARRAY_BUFFER, m_tbo);
-			glBufferData(GL_ARRAY_BUFFER, sizeof(tcs), tcs, GL_STATIC_DRAW);
-			glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 2, NULL);
-			glBindBuffer(GL_ARRAY_BUFFER, 0);
+	private:
 
+		void CreateTexture(Image* img)
+		{
 			//TEXTURE
 			glGenTextures(1, &m_tex);
 			Bindings::BindTexture(m_tex);
@@ -2356,7 +2846,7 @@ return T();
 			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, img->GetWidth(), img->GetHeight(), 0, GL_RGBA, GL_UNSIGNED_BYTE, img->GetData());
 		}
 
-		unsigned int m_vao = 0, m_vbo = 0, m_tbo = 0, m_tex = 0;
+		unsigned int m_tex = 0, m_width, m_height;
 		
 		bool m_textured;	
 	};
@@ -2391,11 +2881,15 @@ return T();
 		}			
 
 		//DO NOT USE.
-		inline void Render()
+		inline void Render(ParticleCore* core)
+		{
+			core->Render(m_vec, m_scale, m_color);
+		}
+
+		//DO NOT USE. Returns the data the instance batch draws this particle with.
+		inline InstanceVertex GetInstance()
 		{
-			Shaders::ts->SetPosition(m_vec);
-			Shaders::ts->SetScale(m_scale);
-			Shaders::ts->SetColor(m_color);
+			return { (float)m_vec.x, (float)m_vec.y, m_scale.x, m_scale.y, m_color };
 		}
 
 	private:
@@ -2429,18 +2923,35 @@ return T();
 					m_canrender[i] = !m_instances[i]->Update();
 		}
 
-		//DO NOT USE.
+		//DO NOT USE. Each run of particles of the same core is drawn with one instanced draw call when the driver supports it, so particles still overlap in the order they were created.
 		void Render()
 		{
-			for (int i = 0; i < m_instances.size(); ++i)
+			if (!Batching::ib || Queueing::s_recording)
 			{
-				if (m_canrender[i])
-				{ 
-					m_cores[i]->RenderCore();
-					m_instances[i]->Render();
-					glDrawArrays(GL_TRIANGLES, 0, 12);
+				for (unsigned int i = 0; i < m_instances.size(); ++i)
+				{
+					if (m_canrender[i])
+						m_instances[i]->Render(m_cores[i]);
+				}
+				return;
+			}
+
+			ParticleCore* core = NULL;
+			m_run.clear();
+			for (unsigned int i = 0; i < m_instances.size(); ++i)
+			{
+				if (!m_canrender[i])
+					continue;
+				if (m_cores[i] != core && !m_run.empty())
+				{
+					Batching::ib->Draw(core->GetTexture(), core->GetSize(), m_run);
+					m_run.clear();
 				}
+				core = m_cores[i];
+				m_run.push_back(m_instances[i]->GetInstance());
 			}
+			if (!m_run.empty())
+				Batching::ib->Draw(core->GetTexture(), core->GetSize(), m_run);
 		}
 
 		//Removes all particles from the list.
@@ -2451,9 +2962,12 @@ return T();
 			m_cores.clear();
 			m_instances.clear();
 			m_canrender.clear();
+			m_run.clear();
 		}
 
 	private:
+		//The instances of the run of particles being drawn, kept to reuse its memory
+		std::vector<InstanceVertex> m_run;
 		std::vector<ParticleCore*> m_cores;
 		std::vector<ParticleInstance*> m_instances;
 		std::vector<bool> m_canrender;
@@ -2500,6 +3014,14 @@ return T();
 			return m_tex;
 		}
 
+		//DO NOT USE. Gives the atlas image to the caller, which has to delete it.
+		inline Image* Release()
+		{
+			Image* atlas = m_atlas;
+			m_atlas = NULL;
+			return atlas;
+		}
+
 	private:
 		Image* m_atlas;
 		unsigned int m_lastx = 0;
@@ -2509,8 +3031,8 @@ return T();
 	{
 	public:
 		inline Sprite() {}
-		//All images must be the same size. Different size images will bug when rendered. Only call after Window::Create().
-		Sprite(std::vector<Image*> img) 
+		//All images must be the same size. Different size images will bug when rendered. Only call after Window::Create(). Set retain to keep the pixels so the sprite can also be drawn by a SoftwareRenderer. Without a window, they are always kept.
+		Sprite(std::vector<Image*> img, bool retain = false) 
 		{
 			unsigned int width = 0, height;
 			height = img[0]->GetHeight();
@@ -2518,38 +3040,35 @@ return T();
 				width += img[i]->GetWidth();
 			SpriteAtlas* atlas = new SpriteAtlas(Size(width, height));
 
-			GenerateVBO(img[0]->GetWidth(), img[0]->GetHeight());
-
 			for (int i = 0; i < img.size(); i++)
 			{
 				atlas->AddImage(img[i]);
-				
-				m_vao.push_back(0);
-				glGenVertexArrays(1, &m_vao[i]);
-				glBindVertexArray(m_vao[i]);
-
-				m_tbo.push_back(GenerateTBO(i * img[0]->GetWidth(), img[i]->GetWidth(), width));
+				m_u.push_back((float)(i * img[0]->GetWidth()) / width);
+				m_u.push_back((float)(i * img[0]->GetWidth() + img[i]->GetWidth()) / width);
 			}
+			m_width = img[0]->GetWidth();
+			m_height = height;
 
-			m_tex = atlas->Finalize();
+			if (Bindings::s_context)
+				m_tex = atlas->Finalize();
+			if (retain || !Bindings::s_context)
+				m_pixels = atlas->Release();
 			delete atlas;
 		}
 		~Sprite() {
 			if (m_tex)
 			{ 
-				glDeleteBuffers(m_tbo.size(), m_tbo.data());
-				glDeleteVertexArrays(m_vao.size(), m_vao.data());
+				Bindings::FlushBatch();
 				glDeleteTextures(1, &m_tex);
-				glDeleteBuffers(1, &m_vbo);
 			}
+			if (m_pixels)
+				delete m_pixels;
 		}
 
 		//DO NOT USE.
-		inline void Render()
+		inline void Render(vec2 pos, vecf scale, Color color)
 		{
-			Bindings::BindTexture(m_tex);
-			Bindings::BindVAO(m_vao[m_state]);
-			glDrawArrays(GL_TRIANGLES, 0, 12);
+			Batching::sb->Add(m_tex, pos.x, pos.y, m_width * scale.x, m_height * scale.y, m_u[m_state * 2], 0, m_u[m_state * 2 + 1], 1, color);
 		}
 
 		//Sets the image to render.
@@ -2559,49 +3078,11 @@ return T();
 		}
 
 	private:	
-		std::vector<unsigned int> m_tbo;
-		std::vector<unsigned int> m_vao;
-		unsigned int m_vbo, m_tex, m_state = 0;
-
-		unsigned int GenerateTBO(unsigned int x, unsigned int sx, unsigned int t)
-		{
-			unsigned int ret;
-			float tcs[12] = 
-			{
-				(float) x / t, (float) 0,
-				(float) (x + sx) / t, (float) 1,
-				(float)(x + sx) / t, (float) 0,
-				(float)x / t, (float)0,
-				(float)(x + sx) / t, (float)1,
-				(float)x / t, (float)1
-			};
-
-			glGenBuffers(1, &ret);
-			glBindBuffer(GL_ARRAY_BUFFER, ret);
-			glBufferData(GL_ARRAY_BUFFER, sizeof(tcs), tcs, GL_STATIC_DRAW);
-			glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 2, NULL);
-			glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-			glVertexAttribPointer(0, 2, VERTEX_TYPE, GL_FALSE, sizeof(int) * 2, NULL);
-			glBindBuffer(GL_ARRAY_BUFFER, 0);
-			return ret;
-		}
-
-		void GenerateVBO(unsigned int width, unsigned int height)
-		{
-			HALF_VERT vecs[12] =
-			{
-				0, 0,
-				(int)width, (int)height,
-				(int)width, 0,
-				0, 0,
-				(int)width, (int)height,
-				0, (int)height
-			};
+		std::vector<float> m_u;
+		unsigned int m_tex = 0, m_state = 0, m_width, m_height;
+		Image* m_pixels = NULL;
 
-			glGenBuffers(1, &m_vbo);
-			glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-			glBufferData(GL_ARRAY_BUFFER, sizeof(vecs), vecs, GL_STATIC_DRAW);			
-		}
+		friend class SoftwareRenderer;
 	};
 	
 	//The base component for tilemapping. It is an image or an image array that can be animated and will be drawn to render terrains.
@@ -2614,8 +3095,6 @@ return T();
 		inline Tile(Image* image, bool hasalpha, bool hascollision)
 		{
 			m_anim = std::vector<Image*>();
-			m_tbo = std::vector<unsigned int>(1);
-			m_vao = std::vector<unsigned int>(1);
 			m_x = std::vector<unsigned int>(1);
 			m_y = std::vector<unsigned int>(1);
 			m_interval = 0;
@@ -2628,8 +3107,6 @@ return T();
 		inline Tile(std::vector<Image*> images, bool hasalpha, bool hascollision, unsigned int interval)
 		{
 			m_anim = images;
-			m_vao = std::vector<unsigned int>(images.size());
-			m_tbo = std::vector<unsigned int>(images.size());
 			m_x = std::vector<unsigned int>(images.size());
 			m_y = std::vector<unsigned int>(images.size());
 			m_alpha = hasalpha;
@@ -2656,39 +3133,38 @@ return T();
 			return m_anim.size();
 		}
 
-		//DO NOT USE BY YOURSELF. This is gonna be called in the TileAtlas.
-		inline void Finalize(unsigned int t, unsigned int w, unsigned int h, unsigned int vbo)
+		//Returns the animation frame being displayed.
+		inline unsigned int GetAnimationState()
 		{
-			for (unsigned int i = 0; i < m_anim.size(); i++)
-			{ 
-				glGenVertexArrays(1, &m_vao[i]);
-				Bind(i);
-				glVertexAttribPointer(0, 2, VERTEX_TYPE, GL_FALSE, sizeof(int) * 2, NULL);
+			return m_animstate;
+		}
 
-				float tcs[12] =
-				{
-					(float)m_x[i] * t / w, (float)m_y[i] * t / h,
-					(float)(t + m_x[i] * t) / w, (float)(t + m_y[i] * t) / h,
-					(float)(t + m_x[i] * t) / w, (float)m_y[i] * t / h,
-					(float)m_x[i] * t / w, (float)m_y[i] * t / h,
-					(float)(t + m_x[i] * t) / w, (float)(t + m_y[i] * t) / h,
-					(float)m_x[i] * t / w, (float)(t + m_y[i] * t) / h
-				};
+		//Returns if the tile changes frames over time.
+		inline bool IsAnimated()
+		{
+			return m_interval > 0 && m_anim.size() > 1;
+		}
 
-				glGenBuffers(1, &m_tbo[i]);
-				glBindBuffer(GL_ARRAY_BUFFER, m_tbo[i]);
-				glBufferData(GL_ARRAY_BUFFER, sizeof(tcs), tcs, GL_STATIC_DRAW);
-				glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 2, NULL);
-				glBindBuffer(GL_ARRAY_BUFFER, vbo);
-			}
+		//DO NOT USE. Returns the cell of the atlas where a frame of this tile was placed.
+		inline vec2 GetAtlasLocation(unsigned int index)
+		{
+			return vec2(m_x[index], m_y[index]);
+		}
+
+		//DO NOT USE BY YOURSELF. This is gonna be called in the TileAtlas.
+		inline void Finalize(unsigned int t, unsigned int w, unsigned int h)
+		{
+			m_size = t;
+			m_uv.clear();
+			for (unsigned int i = 0; i < m_anim.size(); i++)
+				m_uv.insert(m_uv.end(), { (float)m_x[i] * t / w, (float)m_y[i] * t / h, (float)(t + m_x[i] * t) / w, (float)(t + m_y[i] * t) / h });
 		}
 
 		//DO NOT USE. This is called when rendering a terrain.
-		inline void Render(unsigned int x, unsigned int y)
-		{			
-			Shaders::ts->SetPosition(vec2(x, y));	
-			Bind(m_animstate);
-			glDrawArrays(GL_TRIANGLES, 0, 12);
+		inline void Render(unsigned int tex, int x, int y, Color color)
+		{
+			float* uv = &m_uv[m_animstate * 4];
+			Batching::sb->Add(tex, x, y, m_size, m_size, uv[0], uv[1], uv[2], uv[3], color);
 		}
 
 		//Advances to the next animation state
@@ -2720,20 +3196,14 @@ return T();
 			return m_col;
 		}
 
-		inline ~Tile() {
-			glDeleteVertexArrays(m_vao.size(), m_vao.data());
-			glDeleteBuffers(m_tbo.size(), m_tbo.data());
-		}
+		inline ~Tile() {}
 
 	private:
 		std::vector<Image*> m_anim;
 		bool m_alpha = false, m_col = false;
-		unsigned int m_animstate = 0, m_interval;
-		std::vector<unsigned int> m_vao, m_tbo, m_x, m_y;
-		inline void Bind(unsigned int state)
-		{			
-			Bindings::BindVAO(m_vao[state]);
-		}
+		unsigned int m_animstate = 0, m_interval, m_size = 0;
+		std::vector<unsigned int> m_x, m_y;
+		std::vector<float> m_uv;
 	};
 	
 	class TileAtlas
@@ -2762,11 +3232,11 @@ return T();
 			if (m_atlas)
 				delete m_atlas;
 
-			if (m_vbo)
-				glDeleteBuffers(GL_ARRAY_BUFFER, &m_vbo);
-
 			if (m_tex)
-				glDeleteTextures(GL_TEXTURE_2D, &m_tex);
+			{
+				Bindings::FlushBatch();
+				glDeleteTextures(1, &m_tex);
+			}
 
 			for (unsigned int i = 0; i < m_width; i++)
 				delete[] m_ocp[i];
@@ -2815,6 +3285,14 @@ return T();
 		//You should call this function before using this to render terrains.
 		void Finalize()
 		{
+			for (unsigned int i = 0; i < m_list.size(); i++)
+			{
+				m_list[i]->Finalize(m_ts, m_atlas->GetWidth(), m_atlas->GetHeight());
+				m_last.push_back(Time::TimeInMilliseconds());
+			}
+			if (!Bindings::s_context)
+				return;
+
 			//Create Texture
 			glGenTextures(1, &m_tex);
 			Bind();
@@ -2823,30 +3301,12 @@ return T();
 			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, m_atlas->GetWidth(), m_atlas->GetHeight(), 0, GL_RGBA, GL_UNSIGNED_BYTE, m_atlas->GetData());
+		}
 
-			//Create general VBO
-			HALF_VERT vecs[12] =
-			{
-				0, 0,
-				(int)m_ts, (int)m_ts,
-				(int)m_ts, 0,
-				0, 0,
-				(int)m_ts, (int)m_ts,
-				0, (int)m_ts
-			};
-
-			glGenBuffers(1, &m_vbo);
-			glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-			glBufferData(GL_ARRAY_BUFFER, sizeof(vecs), vecs, GL_STATIC_DRAW);
-			
-			for (int i = 0; i < m_list.size(); i++)
-			{
-				m_list[i]->Finalize(m_ts, m_atlas->GetWidth(), m_atlas->GetHeight(), m_vbo);
-				m_last.push_back(Time::TimeInMilliseconds());
-				glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-			}
-
-			glBindBuffer(GL_ARRAY_BUFFER, 0);
+		//DO NOT USE. Returns the atlas pixels.
+		inline Image* GetImage()
+		{
+			return m_atlas;
 		}
 
 		//Must be called every frame
@@ -2857,9 +3317,28 @@ return T();
 				{ 
 					m_list[i]->NextState();
 					m_last[i] = Time::TimeInMilliseconds();
+					m_animversion++;
 				}
 		}
 
+		//DO NOT USE. Returns a counter that changes every time an animated tile advances a frame.
+		inline unsigned int GetAnimationVersion()
+		{
+			return m_animversion;
+		}
+
+		//Returns the number of tiles added to the atlas.
+		inline unsigned int GetTileCount()
+		{
+			return m_list.size();
+		}
+
+		//Returns the size of the atlas texture in pixels.
+		inline Size GetPixelSize()
+		{
+			return Size(m_atlas->GetWidth(), m_atlas->GetHeight());
+		}
+
 		//DO NOT USE. This is OpenGL related.
 		inline unsigned int GetTextureID()
 		{
@@ -2876,7 +3355,7 @@ return T();
 		Image* m_atlas;
 		bool** m_ocp;
 	
-		unsigned int m_width, m_height, m_ts, m_tex, m_vbo;
+		unsigned int m_width, m_height, m_ts, m_tex = 0, m_animversion = 0;
 		std::vector<Tile*> m_list;
 		std::vector<unsigned long long> m_last;
 
@@ -2896,7 +3375,12 @@ return T();
 			m_width = 0;
 			m_height = 0;
 		}
-		inline ~Camera() {}
+		//Draws the recorded frame first because it may still use the camera.
+		inline ~Camera()
+		{
+			Bindings::FlushBatch();
+			Bindings::ForgetLighting(this);
+		}
 
 		//Sets the size of the camera grid.
 		inline void SetSize(Size size)
@@ -2951,14 +3435,27 @@ return T();
 	//DO NOT USE. This is integrated in the terrain class.
 	class LightMap
 	{
-		struct LightTile
+		//A light and how much of it reaches the (2 * range + 1)^2 tiles around it, row after row, from 0 to 255
+		struct Light
 		{
-			Color c;
-			unsigned short averages;
-			unsigned int id;
+			int x, y;
+			unsigned int range;
+			Color color;
+			bool mix;
+			std::vector<unsigned char> strength;
 		};
 
 	public:
+		//The cost of a straight and a diagonal step of a light. Their ratio is close to the square root of 2 so lights are round.
+		static const unsigned int StraightStep = 5, DiagonalStep = 7;
+
+		//DO NOT USE. Space Propagate() works in: the cheapest cost found for every tile around a light and the buckets of tiles to visit. One per thread.
+		struct Scratch
+		{
+			std::vector<unsigned int> cost;
+			std::vector<int> buckets[DiagonalStep + 1];
+		};
+
 		inline LightMap() {}
 
 		//DO NOT USE. This is integrated in the terrain class.
@@ -2966,721 +3463,4687 @@ return T();
 		{
 			m_width = size.width;
 			m_height = size.height;
+			m_back = color;
 
-			m_data = new LightTile*[size.width];
-			for (unsigned int x = 0; x < size.width; x++)
+			size_t tiles = (size_t)size.width * size.height;
+			for (int c = 0; c < 3; c++)
 			{
-				m_data[x] = new LightTile[size.height];
+				m_mixed[c] = std::vector<float>(tiles, 0);
+				m_brightest[c] = std::vector<float>(tiles, 0);
 			}
-
-			for (int x = 0; x < m_width; x++)
-				for (int y = 0; y < m_height; y++)
-				{ 
-					LightTile tile;
-					tile.c = color;
-					tile.averages = 1;
-					tile.id = 0;
-					m_data[x][y] = tile;
-				}
+			m_colors = std::vector<Color>(tiles, color);
 		}
 
-		//DO NOT USE. This is integrated in the terrain class.
-		unsigned int AddLight(unsigned int range, Color color, int xpos, int ypos, bool avg)
+		//DO NOT USE. This is integrated in the terrain class. walls are the (2 * range + 1)^2 tiles around the light, row after row, where every tile that isn't 0xffffffff stops it. NULL if nothing does.
+		unsigned int AddLight(unsigned int range, Color color, int xpos, int ypos, bool avg, const unsigned int* walls = NULL)
 		{
 			unsigned int id = m_cid;
 			m_cid++;
-			
-			SetTileColor(color, xpos, ypos, id, avg);
-	
-			for (int r = 0; r < range; r++)
-			{ 
-				for (int x = xpos - range + 1; x < xpos + range; x++)
-					for (int y = ypos - range + 1; y < ypos + range; y++)
-					{ 
-						SetTileColor(color, x - 1, y, id, avg);
-						SetTileColor(color, x + 1, y, id, avg);
-						SetTileColor(color, x, y + 1, id, avg);
-						SetTileColor(color, x, y - 1, id, avg);
-					}
-			}
 
+			Light& light = m_lights[id];
+			light.range = range;
+			light.color = color;
+			light.mix = avg;
+			Place(light, xpos, ypos, walls);
 			return id;
 		}
 
+		//DO NOT USE. This is integrated in the terrain class. Takes the light out of the tiles it reached and spreads it again from its new tile.
+		bool MoveLight(unsigned int id, int xpos, int ypos, const unsigned int* walls = NULL)
+		{
+			auto it = m_lights.find(id);
+			if (it == m_lights.end())
+				return false;
+			Take(it->second);
+			Place(it->second, xpos, ypos, walls);
+			return true;
+		}
+
+		//DO NOT USE. This is integrated in the terrain class. The light keeps the tiles it reaches.
+		bool SetLightColor(unsigned int id, Color color)
+		{
+			auto it = m_lights.find(id);
+			if (it == m_lights.end())
+				return false;
+			Take(it->second);
+			it->second.color = color;
+			Apply(it->second);
+			return true;
+		}
+
 		//DO NOT USE. This is integrated in the terrain class.
-		inline void SetTileColor(Color c, int x, int y, unsigned int id, bool avg)
+		bool RemoveLight(unsigned int id)
 		{
-			if (x < m_width && y < m_height)
-			{
-				if (avg)
-				{ 
-					if (m_data[x][y].id != id)
-					{ 
-					unsigned int r = m_data[x][y].c.R * m_data[x][y].averages + c.R, g = m_data[x][y].c.G * m_data[x][y].averages + c.G,
-						b = m_data[x][y].c.B * m_data[x][y].averages + c.B, a = m_data[x][y].c.A * m_data[x][y].averages + c.A;
-					m_data[x][y].averages++;
-					m_data[x][y].c = Color(r / m_data[x][y].averages, g / m_data[x][y].averages, b / m_data[x][y].averages, a / m_data[x][y].averages);					
-					m_data[x][y].id = id;
-					}
-				}
-				else
-				{ 
-					m_data[x][y].c = c;
-					m_data[x][y].id = id;
-				}
-			}
+			auto it = m_lights.find(id);
+			if (it == m_lights.end())
+				return false;
+			Take(it->second);
+			m_lights.erase(it);
+			return true;
+		}
+
+		//DO NOT USE. Gets a light's position and range so the tiles it lights can be found. Returns false if it doesn't exist.
+		bool GetLight(unsigned int id, int& xpos, int& ypos, unsigned int& range)
+		{
+			auto it = m_lights.find(id);
+			if (it == m_lights.end())
+				return false;
+			xpos = it->second.x;
+			ypos = it->second.y;
+			range = it->second.range;
+			return true;
 		}
 
 		//DO NOT USE. This is integrated in the terrain class.
 		inline Color GetTileColor(int x, int y)
 		{
-			if (x < m_width && y < m_height)
-				return m_data[x][y].c;
+			if ((unsigned int)x < m_width && (unsigned int)y < m_height)
+				return m_colors[(size_t)y * m_width + x];
 			return Color(255, 255, 255, 255);
 		}
 
-		~LightMap() 
+		//DO NOT USE. The color of every tile, row after row.
+		inline const Color* GetColors()
 		{
-			for (unsigned int x = 0; x < m_width; x++)
-			{
-				delete[] m_data[x];
-			}
-			delete[] m_data;
+			return m_colors.data();
 		}
 
-	private:
-		LightTile** m_data;
-		unsigned int m_width, m_height, m_cid = 1;
-	};
-	
-	//A tilemap terrain
-	class Terrain
-	{
-	public:
-		inline Terrain() {}
-		Terrain(Size size, unsigned int layers = 1, Color LightmapBackcolor = Color(255, 255, 255))
+		//DO NOT USE. Returns the handles of every light, oldest first.
+		std::vector<unsigned int> GetLights()
 		{
-			m_light = new LightMap(size, LightmapBackcolor);
-			data = new unsigned int**[layers];
+			std::vector<unsigned int> ids;
+			ids.reserve(m_lights.size());
+			for (auto& light : m_lights)
+				ids.push_back(light.first);
+			std::sort(ids.begin(), ids.end());
+			return ids;
+		}
 
-			for (int l = 0; l < layers; l++)
-			{ 
-				data[l] = new unsigned int*[size.width];
-				for (unsigned int x = 0; x < size.width; x++)
-				{ 
-					data[l][x] = new unsigned int[size.height];
-				}
-			}
-			m_width = size.width;
-			m_height = size.height;
-			m_layers = layers;
+		//DO NOT USE. Spreads a light again without changing the tiles, for Rebuild(). Lights can be spread on several threads at once, each with its own scratch.
+		void Spread(unsigned int id, const unsigned int* walls, Scratch& scratch)
+		{
+			auto it = m_lights.find(id);
+			if (it != m_lights.end())
+				Propagate(it->second, walls, scratch);
+		}
 
-			for (int i = 0; i < layers; i++)
+		//DO NOT USE. Rebuilds the rows from y1 to y2 from the lights, added in the order given. Bands of rows can be rebuilt on several threads at once.
+		void Rebuild(int y1, int y2, const std::vector<unsigned int>& ids)
+		{
+			y1 = std::max(y1, 0);
+			y2 = std::min(y2, (int)m_height);
+			if (y1 >= y2)
+				return;
+			size_t first = (size_t)y1 * m_width, last = (size_t)y2 * m_width;
+			for (int c = 0; c < 3; c++)
 			{
-				FillLayer(i, 0);
+				std::fill(m_mixed[c].begin() + first, m_mixed[c].begin() + last, 0.0f);
+				std::fill(m_brightest[c].begin() + first, m_brightest[c].begin() + last, 0.0f);
+			}
+			for (unsigned int id : ids)
+			{
+				const Light& light = m_lights.find(id)->second;
+				int x1, ly1, x2, ly2;
+				Bounds(light, x1, ly1, x2, ly2);
+				ly1 = std::max(ly1, y1);
+				ly2 = std::min(ly2, y2);
+				if (x1 >= x2 || ly1 >= ly2)
+					continue;
+				ApplyRows(light, x1, ly1, x2, ly2);
 			}
+			for (int y = y1; y < y2; y++)
+				ResolveRow((size_t)y * m_width, m_width);
 		}
 
-		Terrain(std::wstring filepath, Color LightmapBackcolor = Color(255, 255, 255))
+		//DO NOT USE. Changes the color of the tiles no light reaches. Call Resolve() for the rows to show it.
+		inline void SetBackColor(Color color)
 		{
-			IO::BinaryFile file = IO::BinaryFile(filepath);
-			std::vector<unsigned char> buffer = std::vector<unsigned char>();
-			unsigned char* filedata = file.GetData();
-			for (int i = 0; i < file.GetSize(); i++)
-				buffer.push_back(filedata[i]);
-			std::vector<unsigned char> tmp;
-			tmp = { buffer[0], buffer[1], buffer[2], buffer[3] };
-			m_width = BinaryConverter::ToType<unsigned int>(tmp);
-			tmp = { buffer[4], buffer[5], buffer[6], buffer[7] };
-			m_height = BinaryConverter::ToType<unsigned int>(tmp);
-			tmp = { buffer[8], buffer[9], buffer[10], buffer[11] };
-			m_layers = BinaryConverter::ToType<unsigned int>(tmp);
+			m_back = color;
+		}
 
-			m_light = new LightMap(Size(m_width, m_height), LightmapBackcolor);
-			data = new unsigned int**[m_layers];
+		//DO NOT USE. Works out the colors of the rows from y1 to y2 again.
+		void Resolve(int y1, int y2)
+		{
+			for (int y = std::max(y1, 0); y < std::min(y2, (int)m_height); y++)
+				ResolveRow((size_t)y * m_width, m_width);
+		}
 
-			for (int l = 0; l < m_layers; l++)
-			{
-				data[l] = new unsigned int*[m_width];
-				for (unsigned int x = 0; x < m_width; x++)
-				{
-					data[l][x] = new unsigned int[m_height];
-				}
-			}
+	private:
+		unsigned int m_width, m_height, m_cid = 1;
+		Color m_back;
+		//One plane per channel, row after row, in 1/255ths of a color step: the sum of the mixed lights and the brightest unmixed light. Lights add whole numbers so taking them out is exact.
+		std::vector<float> m_mixed[3], m_brightest[3];
+		//What every tile looks like: the back color plus the mixed lights, or the brightest unmixed light if that is brighter
+		std::vector<Color> m_colors;
+		std::unordered_map<unsigned int, Light> m_lights;
+		Scratch m_scratch;
 
-			int s = 12;
+		inline void Place(Light& light, int xpos, int ypos, const unsigned int* walls)
+		{
+			light.x = xpos;
+			light.y = ypos;
+			Propagate(light, walls, m_scratch);
+			Apply(light);
+		}
 
-			for (int l = 0; l < m_layers; l++)
-			{
-				for (int x = 0; x < m_width; x++)
-				{
-					for (int y = 0; y < m_height; y++)
-					{
-						tmp = { buffer[s], buffer[s + 1], buffer[s + 2], buffer[s + 3] };
-						data[l][x][y] = BinaryConverter::ToType<unsigned int>(tmp);
-						s += 4;
-					}
-				}
-			}
+		//The part of the tiles around a light that is inside the map
+		inline void Bounds(const Light& light, int& x1, int& y1, int& x2, int& y2)
+		{
+			x1 = std::max(light.x - (int)light.range, 0);
+			y1 = std::max(light.y - (int)light.range, 0);
+			x2 = std::min(light.x + (int)light.range + 1, (int)m_width);
+			y2 = std::min(light.y + (int)light.range + 1, (int)m_height);
 		}
 
-		//Gets the tile id of a place in the terrain.
-		inline unsigned int GetTile(unsigned int layer, unsigned int x, unsigned int y)
+		//The strengths of a light from a tile to the right
+		inline const unsigned char* Strength(const Light& light, int x, int y)
 		{
-			if (x < m_width && y < m_height && layer < m_layers)
-				return data[layer][x][y];
-			else
-				return 0xffffffff;
+			return light.strength.data() + (y - light.y + (int)light.range) * (2 * light.range + 1) + x - light.x + (int)light.range;
 		}
 
-		//Sets the tile id of a place in the terrain.
-		inline void SetTile(unsigned int layer, unsigned int x, unsigned int y, unsigned int value)
+		//Adds a light to the tiles it reaches a row at a time. Mixed lights are summed so they can be taken out exactly, the others are kept if they are the brightest.
+		void Apply(const Light& light)
 		{
-			if (x < m_width && y < m_height && layer < m_layers)
-				data[layer][x][y] = value;
+			int x1, y1, x2, y2;
+			Bounds(light, x1, y1, x2, y2);
+			ApplyRows(light, x1, y1, x2, y2);
+			for (int y = y1; y < y2; y++)
+				ResolveRow((size_t)y * m_width + x1, x2 - x1);
 		}
 
-		//Fills a layer with a tile.
-		inline void FillLayer(unsigned int layer, unsigned int value)
+		//Adds a light to a rectangle of its tiles without working out their colors.
+		void ApplyRows(const Light& light, int x1, int y1, int x2, int y2)
 		{
-			for (int x = 0; x < m_width; x++)
+			const unsigned char channels[3] = { light.color.R, light.color.G, light.color.B };
+			for (int y = y1; y < y2; y++)
 			{
-				for (int y = 0; y < m_height; y++)
+				size_t i = (size_t)y * m_width + x1;
+				for (int c = 0; c < 3; c++)
 				{
-					data[layer][x][y] = value;
+					if (light.mix)
+						AddRow(m_mixed[c].data() + i, Strength(light, x1, y), (float)channels[c], x2 - x1);
+					else
+						MaxRow(m_brightest[c].data() + i, Strength(light, x1, y), (float)channels[c], x2 - x1);
 				}
 			}
 		}
 
-		//Returns the width of the terrain.
-		inline unsigned int GetWidth()
+		//Takes a light out of the tiles it reaches. Mixed lights are subtracted, the brightest of the other lights is found again from the ones overlapping it.
+		void Take(const Light& light)
 		{
-			return m_width;
-		}
+			int x1, y1, x2, y2;
+			Bounds(light, x1, y1, x2, y2);
+			const unsigned char channels[3] = { light.color.R, light.color.G, light.color.B };
+			for (int y = y1; y < y2; y++)
+			{
+				size_t i = (size_t)y * m_width + x1;
+				for (int c = 0; c < 3; c++)
+				{
+					if (light.mix)
+						AddRow(m_mixed[c].data() + i, Strength(light, x1, y), -(float)channels[c], x2 - x1);
+					else
+						std::fill(m_brightest[c].begin() + i, m_brightest[c].begin() + i + (x2 - x1), 0.0f);
+				}
+			}
 
-		//Returns the height of the terrain.
-		inline unsigned int GetHeight()
-		{
-			return m_height;
+			if (!light.mix)
+				for (auto& other : m_lights)
+				{
+					const Light& l = other.second;
+					int ox1, oy1, ox2, oy2;
+					Bounds(l, ox1, oy1, ox2, oy2);
+					ox1 = std::max(ox1, x1);
+					oy1 = std::max(oy1, y1);
+					ox2 = std::min(ox2, x2);
+					oy2 = std::min(oy2, y2);
+					if (&l == &light || l.mix || ox1 >= ox2 || oy1 >= oy2)
+						continue;
+					const unsigned char colors[3] = { l.color.R, l.color.G, l.color.B };
+					for (int y = oy1; y < oy2; y++)
+						for (int c = 0; c < 3; c++)
+							MaxRow(m_brightest[c].data() + (size_t)y * m_width + ox1, Strength(l, ox1, y), (float)colors[c], ox2 - ox1);
+				}
+
+			for (int y = y1; y < y2; y++)
+				ResolveRow((size_t)y * m_width + x1, x2 - x1);
 		}
 
-		//Returns the number of layers in the terrain.
-		inline unsigned int GetLayerCount()
+		//dst += color * strength, 16 tiles at a time with SSE2.
+		static void AddRow(float* dst, const unsigned char* strength, float color, int count)
 		{
-			return m_layers;
+			int i = 0;
+#ifdef GIZEGO_SSE2
+			__m128 c = _mm_set1_ps(color);
+			for (; i + 16 <= count; i += 16)
+			{
+				__m128 s[4];
+				Unpack(strength + i, s);
+				for (int j = 0; j < 4; j++)
+					_mm_storeu_ps(dst + i + j * 4, _mm_add_ps(_mm_loadu_ps(dst + i + j * 4), _mm_mul_ps(c, s[j])));
+			}
+#endif
+			for (; i < count; i++)
+				dst[i] += color * strength[i];
 		}
 
-		//Adds a light to the terrain lightmap. Wall layer will be the layer of light obstacles (every non-transparent tile)
-		inline void AddLight(unsigned int range, Color color, int x, int y, bool mixlights)
+		//dst = max(dst, color * strength), 16 tiles at a time with SSE2.
+		static void MaxRow(float* dst, const unsigned char* strength, float color, int count)
 		{
-			m_light->AddLight(range, color, x, y, mixlights);
+			int i = 0;
+#ifdef GIZEGO_SSE2
+			__m128 c = _mm_set1_ps(color);
+			for (; i + 16 <= count; i += 16)
+			{
+				__m128 s[4];
+				Unpack(strength + i, s);
+				for (int j = 0; j < 4; j++)
+					_mm_storeu_ps(dst + i + j * 4, _mm_max_ps(_mm_loadu_ps(dst + i + j * 4), _mm_mul_ps(c, s[j])));
+			}
+#endif
+			for (; i < count; i++)
+				dst[i] = std::max(dst[i], color * strength[i]);
 		}
 
-		//DO NOT USE. 
-		inline LightMap* GetLightMap()
+#ifdef GIZEGO_SSE2
+		//Widens 16 strengths to floats.
+		static inline void Unpack(const unsigned char* strength, __m128* out)
 		{
-			return m_light;
+			__m128i zero = _mm_setzero_si128(), bytes = _mm_loadu_si128((const __m128i*)strength);
+			__m128i lo = _mm_unpacklo_epi8(bytes, zero), hi = _mm_unpackhi_epi8(bytes, zero);
+			out[0] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero));
+			out[1] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero));
+			out[2] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero));
+			out[3] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero));
 		}
+#endif
 
-		//Removes all lights and fills the light map with a color.
-		inline void ResetLights(Color BackColor)
-		{
-			if (m_light)
-				delete m_light;
-			m_light = new LightMap(Size(m_width, m_height), BackColor);
+		//Works out the colors of count tiles from the light planes, 4 tiles at a time with SSE2.
+		void ResolveRow(size_t i, int count)
+		{
+			const unsigned char back[3] = { m_back.R, m_back.G, m_back.B };
+			Color* dst = m_colors.data() + i;
+			int x = 0;
+#ifdef GIZEGO_SSE2
+			__m128 scale = _mm_set1_ps(1.0f / 255), top = _mm_set1_ps(255.0f * 255), base[3];
+			for (int c = 0; c < 3; c++)
+				base[c] = _mm_set1_ps(back[c] * 255.0f);
+			__m128i alpha = _mm_set1_epi32((int)m_back.A << 24);
+			for (; x + 4 <= count; x += 4)
+			{
+				__m128i out = alpha;
+				for (int c = 0; c < 3; c++)
+				{
+					__m128 v = _mm_min_ps(_mm_add_ps(base[c], _mm_loadu_ps(m_mixed[c].data() + i + x)), top);
+					v = _mm_max_ps(v, _mm_loadu_ps(m_brightest[c].data() + i + x));
+					out = _mm_or_si128(out, _mm_slli_epi32(_mm_cvtps_epi32(_mm_mul_ps(v, scale)), c * 8));
+				}
+				_mm_storeu_si128((__m128i*)(dst + x), out);
+			}
+#endif
+			for (; x < count; x++)
+			{
+				unsigned char channels[3];
+				for (int c = 0; c < 3; c++)
+				{
+					float v = std::max(std::min(back[c] * 255.0f + m_mixed[c][i + x], 255.0f * 255), m_brightest[c][i + x]);
+					channels[c] = (unsigned char)(v / 255 + 0.5f);
+				}
+				dst[x] = Color(channels[0], channels[1], channels[2], m_back.A);
+			}
 		}
 
-		//Saves a terrain to a file. Lights will not be saved.
-		void SaveToFile(std::wstring filepath)
+		//Walks a light out from its tile cheapest tile first (Dial's algorithm), so every tile it reaches is visited once. Walls are lit but the light doesn't go through them, nor through the corner between two walls.
+		void Propagate(Light& light, const unsigned int* walls, Scratch& scratch)
 		{
-			std::vector<unsigned char> data;
-			std::vector<unsigned char> tmp = BinaryConverter::ToBytes(m_width);
-
-			for (int i = 0; i < tmp.size(); ++i)
-				data.push_back(tmp[i]);
+			int range = light.range, side = 2 * range + 1, x0 = light.x - range, y0 = light.y - range;
+			light.strength.assign(side * side, 0);
+			if ((unsigned int)light.x >= m_width || (unsigned int)light.y >= m_height)
+				return;
 
-			tmp = BinaryConverter::ToBytes(m_height);
-			for (int i = 0; i < tmp.size(); ++i)
-				data.push_back(tmp[i]);
+			unsigned int max = StraightStep * (range + 1);
+			scratch.cost.assign(side * side, max);
+			for (std::vector<int>& bucket : scratch.buckets)
+				bucket.clear();
 
-			tmp = BinaryConverter::ToBytes(m_layers);
-			for (int i = 0; i < tmp.size(); ++i)
-				data.push_back(tmp[i]);
+			int start = range * side + range;
+			scratch.cost[start] = 0;
+			scratch.buckets[0].push_back(start);
+			auto opaque = [&](int x, int y)
+			{
+				return walls && walls[y * side + x] != 0xffffffff;
+			};
 
-			for (int l = 0; l < m_layers; ++l)
+			for (unsigned int cost = 0, queued = 1; queued && cost < max; cost++)
 			{
-				for (int x = 0; x < m_width; ++x)
+				std::vector<int>& bucket = scratch.buckets[cost % (DiagonalStep + 1)];
+				for (size_t i = 0; i < bucket.size(); i++)
 				{
-					for (int y = 0; y < m_height; ++y)
-					{
-						tmp = BinaryConverter::ToBytes(this->data[l][x][y]);
-						for (int i = 0; i < tmp.size(); ++i)
-							data.push_back(tmp[i]);
-					}
+					int index = bucket[i], x = index % side, y = index / side;
+					queued--;
+					if (scratch.cost[index] != cost)
+						continue;
+					light.strength[index] = (unsigned char)std::max(255 - (int)(cost * 255 / max), 1);
+					if (index != start && opaque(x, y))
+						continue;
+
+					for (int dy = -1; dy <= 1; dy++)
+						for (int dx = -1; dx <= 1; dx++)
+						{
+							int nx = x + dx, ny = y + dy;
+							if ((dx == 0 && dy == 0) || nx < 0 || ny < 0 || nx >= side || ny >= side ||
+								(unsigned int)(x0 + nx) >= m_width || (unsigned int)(y0 + ny) >= m_height)
+								continue;
+							if (dx != 0 && dy != 0 && opaque(nx, y) && opaque(x, ny))
+								continue;
+							unsigned int next = cost + (dx != 0 && dy != 0 ? DiagonalStep : StraightStep);
+							int n = ny * side + nx;
+							if (next < scratch.cost[n])
+							{
+								scratch.cost[n] = next;
+								scratch.buckets[next % (DiagonalStep + 1)].push_back(n);
+								queued++;
+							}
+						}
 				}
+				bucket.clear();
 			}
-
-			IO::BinaryFile::Save(filepath, data);
 		}
+	};
+	
+	//Tiles draws every visible tile on its own, Chunks draws prebuilt meshes of ChunkSize * ChunkSize tiles and TileMap draws each layer as one quad that looks its tiles up in a texture.
+	enum TerrainRenderingMode : char
+	{
+		Tiles, Chunks, TileMap
+	};
 
-
-		~Terrain()
+	//DO NOT USE. Chunk codec of compressed terrain files: the tiles are run length encoded, then the runs are compressed with a small LZ77 coder.
+	namespace TerrainCompression
+	{
+		inline void WriteLength(std::vector<unsigned char>& out, size_t length)
 		{
-			if (data)
-			{ 
-				for (int l = 0; l < m_layers; l++)
-				{			
-					for (unsigned int x = 0; x < m_width; x++)
-					{
-						delete[] data[l][x];
-					}
-					delete[] data[l];
-				}
-			}
-			delete m_light;
-			delete[] data;
+			for (; length >= 255; length -= 255)
+				out.push_back(255);
+			out.push_back((unsigned char)length);
 		}
 
-	private:
-		unsigned int*** data;
-		LightMap* m_light;
-		unsigned int m_width, m_height, m_layers;
-	};
-	
-	//Used to check collisions.
-	class TilemapEntity
-	{
-	public:
-		inline TilemapEntity() {}
-		inline TilemapEntity(unsigned int width, unsigned int height)
+		inline bool ReadLength(const unsigned char* src, size_t size, size_t& i, size_t& length)
 		{
-			m_width = width;
-			m_height = height;
+			unsigned char byte;
+			do
+			{
+				if (i >= size)
+					return false;
+				byte = src[i++];
+				length += byte;
+			} while (byte == 255);
+			return true;
 		}
 
-		//Sets the entity size
-		inline void SetSize(unsigned int width, unsigned int height)
+		//Writes literals followed by a match. The last sequence has no match.
+		inline void WriteSequence(std::vector<unsigned char>& out, const unsigned char* literals, size_t count, size_t offset, size_t length)
 		{
-			m_width += width;
-			m_height += height;
+			out.push_back((unsigned char)((std::min(count, (size_t)15) << 4) | (length ? std::min(length - 4, (size_t)15) : 0)));
+			if (count >= 15)
+				WriteLength(out, count - 15);
+			out.insert(out.end(), literals, literals + count);
+			if (length)
+			{
+				out.push_back(offset & 0xff);
+				out.push_back(offset >> 8);
+				if (length - 4 >= 15)
+					WriteLength(out, length - 4 - 15);
+			}
 		}
 
-		//Adds x and y to the entity position checking for collision. layer is the layer where to find walls.
-		bool Move(vec2 pos, int tilesize, int layer, Terrain* ter, TileAtlas* atlas)
+		//Finds repeated sequences of 4 bytes or more up to 65535 bytes back.
+		inline void CompressLZ(const unsigned char* src, size_t size, std::vector<unsigned char>& out)
 		{
-			if ((m_x + m_width) % tilesize == 0)
+			const unsigned int HashBits = 12;
+			int table[1 << HashBits];
+			std::fill(table, table + (1 << HashBits), -1);
+			size_t anchor = 0, i = 0;
+			while (i + 4 <= size)
 			{
-				if (pos.x > 0)
+				unsigned int sequence;
+				memcpy(&sequence, src + i, 4);
+				unsigned int hash = (sequence * 2654435761u) >> (32 - HashBits);
+				int candidate = table[hash];
+				table[hash] = (int)i;
+				if (candidate >= 0 && i - candidate <= 0xffff && !memcmp(src + candidate, src + i, 4))
 				{
-					unsigned int t1 = ter->GetTile(layer, (m_x + m_width) / tilesize, std::floor(m_y / (double)tilesize));
-					unsigned int t2 = ter->GetTile(layer, (m_x + m_width) / tilesize, std::ceil(m_y / (double)tilesize));
-					bool tile1 = false, tile2 = false;
-					if (t1 != 0xffffffff)
-						tile1 = atlas->GetTile(t1)->HasCollision();
-					if (t2 != 0xffffffff)
-						tile2 = atlas->GetTile(t2)->HasCollision();
-
-					if (!(tile1 || tile2))
-					{
-						m_x += pos.x;
-						return true;
-					}
-					else
-						return false;
+					size_t length = 4;
+					while (i + length < size && src[candidate + length] == src[i + length])
+						length++;
+					WriteSequence(out, src + anchor, i - anchor, i - candidate, length);
+					i += length;
+					anchor = i;
 				}
-				else if (pos.x < 0)
-				{
-					unsigned int t1 = ter->GetTile(layer, (m_x + m_width) / tilesize - 2, std::floor(m_y / (double)tilesize));
-					unsigned int t2 = ter->GetTile(layer, (m_x + m_width) / tilesize - 2, std::ceil(m_y / (double)tilesize));
-					bool tile1 = false, tile2 = false;
-					if (t1 != 0xffffffff)
-						tile1 = atlas->GetTile(t1)->HasCollision();
-					if (t2 != 0xffffffff)
-						tile2 = atlas->GetTile(t2)->HasCollision();
+				else
+					i++;
+			}
+			WriteSequence(out, src + anchor, size - anchor, 0, 0);
+		}
 
-					if (!(tile1 || tile2))
-					{
-						m_x += pos.x;
-						return true;
-					}
-					else
-						return false;
-				}
+		inline bool DecompressLZ(const unsigned char* src, size_t size, unsigned char* dst, size_t capacity, size_t& written)
+		{
+			size_t i = 0, o = 0;
+			while (i < size)
+			{
+				unsigned char token = src[i++];
+				size_t count = token >> 4;
+				if (count == 15 && !ReadLength(src, size, i, count))
+					return false;
+				if (count > size - i || count > capacity - o)
+					return false;
+				memcpy(dst + o, src + i, count);
+				i += count;
+				o += count;
+				if (i == size)
+					break;
+
+				if (size - i < 2)
+					return false;
+				size_t offset = src[i] | (src[i + 1] << 8), length = (token & 15) + 4;
+				i += 2;
+				if ((token & 15) == 15 && !ReadLength(src, size, i, length))
+					return false;
+				if (offset == 0 || offset > o || length > capacity - o)
+					return false;
+				//The match can overlap what it writes
+				for (size_t k = 0; k < length; k++)
+					dst[o + k] = dst[o - offset + k];
+				o += length;
 			}
+			written = o;
+			return true;
+		}
 
-			if ((m_y + m_height) % tilesize == 0)
+		//Compresses count tiles of width bytes.
+		inline void EncodeChunk(const unsigned char* tiles, unsigned int count, unsigned int width, std::vector<unsigned char>& out)
+		{
+			std::vector<unsigned char> runs;
+			runs.reserve(count * (width + 1));
+			for (unsigned int i = 0; i < count;)
 			{
-				if (pos.y > 0)
+				unsigned int run = 1;
+				while (i + run < count && !memcmp(tiles + (i + run) * width, tiles + i * width, width))
+					run++;
+				//The run length as 7 bits per byte
+				for (unsigned int value = run; ; value >>= 7)
 				{
-					unsigned int t1 = ter->GetTile(layer, std::floor(m_x / (double)tilesize), (m_y + m_height) / tilesize);
-					unsigned int t2 = ter->GetTile(layer, std::ceil(m_x / (double)tilesize), (m_y + m_height) / tilesize);
-					bool tile1 = false, tile2 = false;
-					if (t1 != 0xffffffff)
-						tile1 = atlas->GetTile(t1)->HasCollision();
-					if (t2 != 0xffffffff)
-						tile2 = atlas->GetTile(t2)->HasCollision();
-
-					if (!(tile1 || tile2))
-					{
-						m_y += pos.y;
-						return true;
-					}
-					else
-						return false;
+					runs.push_back((value & 0x7f) | (value >= 0x80 ? 0x80 : 0));
+					if (value < 0x80)
+						break;
 				}
-				else if (pos.y < 0)
-				{
-					unsigned int t1 = ter->GetTile(layer, std::floor(m_x / (double)tilesize), (m_y + m_height) / tilesize - 2);
-					unsigned int t2 = ter->GetTile(layer, std::ceil(m_x / (double)tilesize), (m_y + m_height) / tilesize - 2);
-					bool tile1 = false, tile2 = false;
-					if (t1 != 0xffffffff)
-						tile1 = atlas->GetTile(t1)->HasCollision();
-					if (t2 != 0xffffffff)
-						tile2 = atlas->GetTile(t2)->HasCollision();
+				runs.insert(runs.end(), tiles + i * width, tiles + (i + 1) * width);
+				i += run;
+			}
+			out.clear();
+			CompressLZ(runs.data(), runs.size(), out);
+		}
 
-					if (!(tile1 || tile2))
-					{
-						m_y += pos.y;
-						return true;
-					}
-					else
+		//The most bytes EncodeChunk() can write for count tiles of width bytes.
+		inline size_t MaxEncodedSize(unsigned int count, unsigned int width)
+		{
+			size_t runs = (size_t)count * (width + 3);
+			return runs + runs / 255 + 16;
+		}
+
+		//Decompresses count tiles of width bytes. Returns false if the data is corrupted.
+		inline bool DecodeChunk(const unsigned char* data, size_t size, unsigned char* tiles, unsigned int count, unsigned int width)
+		{
+			//Every run takes at least one byte more than its value
+			std::vector<unsigned char> runs(count * (width + 3));
+			size_t length;
+			if (!DecompressLZ(data, size, runs.data(), runs.size(), length))
+				return false;
+
+			size_t i = 0;
+			unsigned int tile = 0;
+			while (i < length && tile < count)
+			{
+				unsigned int run = 0;
+				for (unsigned int shift = 0; ; shift += 7)
+				{
+					if (i >= length || shift > 28)
 						return false;
+					run |= (runs[i] & 0x7f) << shift;
+					if (!(runs[i++] & 0x80))
+						break;
 				}
+				if (run == 0 || run > count - tile || length - i < width)
+					return false;
+				for (unsigned int k = 0; k < run; k++)
+					memcpy(tiles + (tile + k) * width, &runs[i], width);
+				i += width;
+				tile += run;
 			}
+			return tile == count && i == length;
+		}
+	}
 
-			m_x += pos.x;
-			m_y += pos.y;
-			return true;
+	//The number of bytes a terrain layer uses for each tile id. The biggest id of a width is no tile.
+	enum TileIdWidth : char
+	{
+		TileId8 = 1, TileId16 = 2, TileId32 = 4
+	};
+
+	class Terrain;
+
+	//A terrain loaded or saved on a worker thread. Deleting the task waits for the work to finish.
+	class TerrainTask
+	{
+	public:
+		~TerrainTask();
+
+		//Checks if the work is finished.
+		inline bool IsDone()
+		{
+			return m_done;
 		}
 
-		//Sets the entity position without checking for collision
-		inline void SetPosition(int x, int y)
+		//Checks if the file couldn't be read or written. Only meaningful once the work is done.
+		inline bool HasFailed()
 		{
-			m_x = x;
-			m_y = y;
+			return m_failed;
 		}
 
-		//Returns the entity X position
-		inline int GetX()
+		//Returns how much of the work is done, from 0 to 1.
+		inline float GetProgress()
 		{
-			return m_x;
+			return m_progress;
 		}
 
-		//Returns the entity Y position
-		inline int GetY()
+		//Waits for the work to finish.
+		inline void Wait()
 		{
-			return m_y;
+			if (m_thread.joinable())
+				m_thread.join();
 		}
 
-		~TilemapEntity() {}
+		//Returns the loaded terrain once the task is done and hands it to the caller, who has to delete it. Returns NULL before that, if the load failed and for saves.
+		Terrain* TakeTerrain();
 
 	private:
-		int m_x = 0, m_y = 0;
-		unsigned int m_width, m_height;
+		friend class Terrain;
+		inline TerrainTask() {}
+
+		std::thread m_thread;
+		std::atomic<float> m_progress{ 0 };
+		std::atomic<bool> m_done{ false }, m_failed{ false };
+		Terrain* m_terrain = NULL;
+		//The snapshot a save writes. It is deleted with the task, on the thread that renders
+		Terrain* m_snapshot = NULL;
 	};
-	
-	class Renderer;
 
-	//An UI element.
-	class UIElement
+	//The tiles of a layer that changed since the last Terrain::DispatchChanges().
+	struct TerrainChange
 	{
-	public:
-
-		//Checks if the mouse in clicking the element.
-		virtual bool IsClicked() = 0;
-		//DO NOT USE.
-		virtual void Render(Renderer*) = 0;
-		//Call this every frame.
-		virtual void Update() = 0;
+		unsigned int layer;
+		//A rectangle from x1, y1 to x2, y2 (excluded) that covers every changed tile
+		unsigned int x1, y1, x2, y2;
+		//One bit per chunk, chunk row after chunk row
+		const unsigned long long* chunks;
+		unsigned int chunkcountx;
 
-		//Sets the component poition.
-		inline void SetPosition(vec2 pos)
+		//Checks if a tile of a chunk changed.
+		inline bool IsChunkDirty(unsigned int cx, unsigned int cy) const
 		{
-			this->pos = pos;
+			unsigned int i = cy * chunkcountx + cx;
+			return (chunks[i >> 6] >> (i & 63)) & 1;
 		}
-		
-		//Gets the poition of the element.
+	};
+
+	//Receives the changes of a layer of a terrain.
+	typedef void(*TerrainChangeCallback)(Terrain* terrain, const TerrainChange& change, void* userdata);
+
+	class TerrainMesh;
+	class TerrainTileMap;
+	class TerrainLightTexture;
+
+	//A tilemap terrain
+	class Terrain
+	{
+	public:
+		//The side length in tiles of the square regions the terrain is split in. Each chunk is stored as ChunkSize rows of ChunkSize tiles.
+		static const unsigned int ChunkSize = 32;
+		//DO NOT USE. ChunkSize is 1 << ChunkShift.
+		static const unsigned int ChunkShift = 5;
+		//DO NOT USE.
+		static const unsigned int ChunkMask = ChunkSize - 1;
+		//DO NOT USE. The first bytes of terrain files since version 2.
+		static const unsigned int FileMagic = 0x52545A47;
+		//DO NOT USE. The version of the files SaveToFile writes. Version 1 files have no header and are converted when opened.
+		static const unsigned int FileVersion = 2;
+		//DO NOT USE. The version of compressed files.
+		static const unsigned int CompressedVersion = 3;
+		//DO NOT USE. The first bytes of terrain journals.
+		static const unsigned int JournalMagic = 0x4A545A47;
+		//DO NOT USE. The version of terrain journals.
+		static const unsigned int JournalVersion = 1;
+
+		inline Terrain() {}
+		Terrain(Size size, unsigned int layers = 1, Color LightmapBackcolor = Color(255, 255, 255)) : Terrain(size, std::vector<TileIdWidth>(layers, TileIdWidth::TileId32), LightmapBackcolor) {}
+
+		//Creates a terrain with one layer per width. Narrow layers use less memory but can only hold small tile ids.
+		Terrain(Size size, std::vector<TileIdWidth> widths, Color LightmapBackcolor = Color(255, 255, 255))
+		{
+			m_light = new LightMap(size, LightmapBackcolor);
+			m_width = size.width;
+			m_height = size.height;
+			m_layers = widths.size();
+			m_widths = widths;
+			CreateStorage();
+
+			for (unsigned int i = 0; i < m_layers; i++)
+			{
+				FillLayer(i, 0);
+			}
+		}
+
+		//Opens a terrain file. Files of the current version are mapped in memory and used as the tile storage, compressed ones are decompressed on every thread and older ones are converted.
+		Terrain(std::wstring filepath, Color LightmapBackcolor = Color(255, 255, 255)) : Terrain(filepath, LightmapBackcolor, NULL) {}
+
+		//Opens a terrain file on a worker thread. Delete the task once you took the terrain.
+		static TerrainTask* LoadAsync(std::wstring filepath, Color LightmapBackcolor = Color(255, 255, 255))
+		{
+			TerrainTask* task = new TerrainTask();
+			task->m_thread = std::thread([task, filepath, LightmapBackcolor]()
+			{
+				task->m_terrain = new Terrain(filepath, LightmapBackcolor, task);
+				task->m_progress = 1;
+				task->m_done = true;
+			});
+			return task;
+		}
+
+		//Saves a snapshot of the terrain on a worker thread, so it can keep changing while it is written. Delete the task once it is done.
+		//The next SaveChanges() writes a full snapshot. The other saves of this terrain wait for this one to finish.
+		TerrainTask* SaveAsync(std::wstring filepath, bool compressed = false)
+		{
+			WaitForSave();
+			if (m_mapping && filepath == m_path)
+				Detach();
+			Terrain* copy = Snapshot();
+			m_journal.clear();
+
+			TerrainTask* task = new TerrainTask();
+			copy->m_task = task;
+			task->m_snapshot = copy;
+			std::shared_ptr<std::promise<void>> saved = std::make_shared<std::promise<void>>();
+			m_saving = saved->get_future().share();
+			task->m_thread = std::thread([task, copy, filepath, compressed, saved]()
+			{
+				copy->SaveToFile(filepath, compressed);
+				task->m_progress = 1;
+				task->m_done = true;
+				saved->set_value();
+			});
+			return task;
+		}
+
+		//Gets the tile id of a place in the terrain.
+		inline unsigned int GetTile(unsigned int layer, unsigned int x, unsigned int y)
+		{
+			if (x < m_width && y < m_height && layer < m_layers)
+				return ReadTile(Chunk(layer, x, y), m_widths[layer], ((y & ChunkMask) << ChunkShift) + (x & ChunkMask));
+			else
+				return 0xffffffff;
+		}
+
+		//Sets the tile id of a place in the terrain. Ids too big for the width of the layer are stored as no tile.
+		inline void SetTile(unsigned int layer, unsigned int x, unsigned int y, unsigned int value)
+		{
+			if (x < m_width && y < m_height && layer < m_layers)
+			{
+				WriteTile(WritableChunk(ChunkIndex(layer, x, y)), m_widths[layer], ((y & ChunkMask) << ChunkShift) + (x & ChunkMask), value);
+				Touch(layer, x, y, x + 1, y + 1);
+			}
+		}
+
+		//Copies count tiles of a row, starting at x, y, to values. Tiles outside the terrain are 0xffffffff.
+		void GetRow(unsigned int layer, int x, int y, unsigned int count, unsigned int* values)
+		{
+			for (unsigned int i = 0; i < count;)
+			{
+				int tx = x + (int)i;
+				if (layer >= m_layers || y < 0 || y >= (int)m_height || tx < 0 || tx >= (int)m_width)
+				{
+					values[i++] = 0xffffffff;
+					continue;
+				}
+				//Copy up to the end of the chunk
+				unsigned int n = std::min({ count - i, ChunkSize - (tx & ChunkMask), m_width - tx });
+				unsigned int offset = ((y & ChunkMask) << ChunkShift) + (tx & ChunkMask);
+				unsigned char* src = Chunk(layer, tx, y);
+				switch (m_widths[layer])
+				{
+				case TileIdWidth::TileId8:
+					Widen((unsigned char*)src + offset, values + i, n);
+					break;
+				case TileIdWidth::TileId16:
+					Widen((unsigned short*)src + offset, values + i, n);
+					break;
+				default:
+					memcpy(values + i, (unsigned int*)src + offset, n * sizeof(unsigned int));
+				}
+				i += n;
+			}
+		}
+
+		//Sets count tiles of a row, starting at x, y, from values. Tiles outside the terrain are ignored.
+		void SetRow(unsigned int layer, int x, int y, unsigned int count, const unsigned int* values)
+		{
+			if (layer >= m_layers || y < 0 || y >= (int)m_height)
+				return;
+			for (unsigned int i = 0; i < count;)
+			{
+				int tx = x + (int)i;
+				if (tx < 0)
+				{
+					i++;
+					continue;
+				}
+				if (tx >= (int)m_width)
+					return;
+				unsigned int n = std::min({ count - i, ChunkSize - (tx & ChunkMask), m_width - tx });
+				unsigned int offset = ((y & ChunkMask) << ChunkShift) + (tx & ChunkMask);
+				unsigned char* dst = WritableChunk(ChunkIndex(layer, tx, y));
+				switch (m_widths[layer])
+				{
+				case TileIdWidth::TileId8:
+					Narrow(values + i, (unsigned char*)dst + offset, n);
+					break;
+				case TileIdWidth::TileId16:
+					Narrow(values + i, (unsigned short*)dst + offset, n);
+					break;
+				default:
+					memcpy((unsigned int*)dst + offset, values + i, n * sizeof(unsigned int));
+				}
+				Touch(layer, tx, y, tx + n, y + 1);
+				i += n;
+			}
+		}
+
+		//Copies a rectangle of tiles to values, row after row. Tiles outside the terrain are 0xffffffff.
+		void GetRegion(unsigned int layer, int x, int y, Size size, unsigned int* values)
+		{
+			for (unsigned int row = 0; row < size.height; row++)
+				GetRow(layer, x, y + (int)row, size.width, values + row * size.width);
+		}
+
+		//Sets a rectangle of tiles from values, row after row. Tiles outside the terrain are ignored.
+		void SetRegion(unsigned int layer, int x, int y, Size size, const unsigned int* values)
+		{
+			for (unsigned int row = 0; row < size.height; row++)
+				SetRow(layer, x, y + (int)row, size.width, values + row * size.width);
+		}
+
+		//DO NOT USE. Returns the tiles of a chunk, ChunkSize rows of ChunkSize tiles of GetLayerWidth() bytes. The tiles past the edges of the terrain are not used.
+		inline unsigned char* GetChunkData(unsigned int layer, unsigned int cx, unsigned int cy)
+		{
+			return m_chunks[(layer * m_chunksy + cy) * m_chunksx + cx];
+		}
+
+		//Returns the number of bytes a layer uses for each tile id.
+		inline TileIdWidth GetLayerWidth(unsigned int layer)
+		{
+			return m_widths[layer];
+		}
+
+		//Fills a layer with a tile.
+		inline void FillLayer(unsigned int layer, unsigned int value)
+		{
+			unsigned int chunks = m_chunksx * m_chunksy;
+			for (unsigned int i = layer * chunks; i < (layer + 1) * chunks; i++)
+				FillTiles(WritableChunk(i), m_widths[layer], ChunkSize * ChunkSize, value);
+			Touch(layer, 0, 0, m_width, m_height);
+		}
+
+		//Fills a rectangle of a layer with a tile. The part outside the terrain is ignored.
+		void FillRect(unsigned int layer, int x, int y, Size size, unsigned int value)
+		{
+			ForEachSpan(layer, x, y, size, [&](unsigned char* tiles, unsigned int count)
+			{
+				FillTiles(tiles, m_widths[layer], count, value);
+				return true;
+			});
+		}
+
+		//Copies a rectangle of a layer of a terrain, which can be this one, to a layer of this terrain. Tiles outside the source are copied as no tile and tiles outside this terrain are ignored.
+		void CopyRegion(Terrain* source, unsigned int srclayer, int sx, int sy, Size size, unsigned int layer, int x, int y)
+		{
+			//Going through a buffer makes overlapping copies and layers of different widths work
+			std::vector<unsigned int> buffer(size.width * size.height);
+			source->GetRegion(srclayer, sx, sy, size, buffer.data());
+			SetRegion(layer, x, y, size, buffer.data());
+		}
+
+		//Replaces a tile by another in a rectangle of a layer. Returns the number of tiles replaced.
+		unsigned int ReplaceInRegion(unsigned int layer, int x, int y, Size size, unsigned int from, unsigned int to)
+		{
+			unsigned int replaced = 0;
+			ForEachSpan(layer, x, y, size, [&](unsigned char* tiles, unsigned int count)
+			{
+				unsigned int n = ReplaceTiles(tiles, m_widths[layer], count, from, to);
+				replaced += n;
+				return n != 0;
+			}, [&](const unsigned char* tiles, unsigned int count)
+			{
+				//Chunks shared with a snapshot are only copied if they have something to replace
+				return HasTile(tiles, m_widths[layer], count, from);
+			});
+			return replaced;
+		}
+
+		//Replaces the area of identical tiles around a place, through their sides, by another tile. Returns the number of tiles replaced.
+		unsigned int FloodFill(unsigned int layer, unsigned int x, unsigned int y, unsigned int value)
+		{
+			if (x >= m_width || y >= m_height || layer >= m_layers)
+				return 0;
+			TileIdWidth width = m_widths[layer];
+			unsigned int target = GetTile(layer, x, y), stored;
+			WriteTile((unsigned char*)&stored, width, 0, value);
+			if (ReadTile((unsigned char*)&stored, width, 0) == target)
+				return 0;
+
+			//Fills a whole row span at a time, then looks for the spans above and below it
+			unsigned int filled = 0;
+			std::vector<std::pair<unsigned int, unsigned int>> seeds = { { x, y } };
+			while (seeds.size())
+			{
+				unsigned int sx = seeds.back().first, sy = seeds.back().second;
+				seeds.pop_back();
+				if (Read(layer, sx, sy) != target)
+					continue;
+				unsigned int left = sx, right = sx;
+				while (left > 0 && Read(layer, left - 1, sy) == target)
+					left--;
+				while (right + 1 < m_width && Read(layer, right + 1, sy) == target)
+					right++;
+				for (unsigned int i = left; i <= right; i++)
+					WriteTile(WritableChunk(ChunkIndex(layer, i, sy)), width, ((sy & ChunkMask) << ChunkShift) + (i & ChunkMask), value);
+				Touch(layer, left, sy, right + 1, sy + 1);
+				filled += right - left + 1;
+
+				for (int ny : { (int)sy - 1, (int)sy + 1 })
+				{
+					if (ny < 0 || ny >= (int)m_height)
+						continue;
+					for (unsigned int i = left; i <= right; i++)
+					{
+						if (Read(layer, i, ny) == target && (i == left || Read(layer, i - 1, ny) != target))
+							seeds.push_back({ i, (unsigned int)ny });
+					}
+				}
+			}
+			return filled;
+		}
+
+		//Returns a terrain with the tiles this one has now, without lights. It shares every chunk with this terrain until one of them changes it, so it only costs a pointer per chunk.
+		//It can be read on another thread while this terrain keeps changing. Delete it when you are done.
+		//A terrain mapped from its file is copied to memory by its first snapshot, so the snapshots never keep the file open and it can still be saved over.
+		Terrain* Snapshot()
+		{
+			if (m_mapping)
+				Detach();
+			Terrain* snapshot = new Terrain();
+			snapshot->m_light = NULL;
+			snapshot->m_width = m_width;
+			snapshot->m_height = m_height;
+			snapshot->m_layers = m_layers;
+			snapshot->m_widths = m_widths;
+			snapshot->CreateTables();
+			snapshot->m_chunks = m_chunks;
+			snapshot->m_owners = m_owners;
+			return snapshot;
+		}
+
+		//Gives this terrain the tiles of a snapshot taken from it, to undo changes. The chunks stay shared.
+		void Restore(Terrain* snapshot)
+		{
+			if (snapshot->m_width != m_width || snapshot->m_height != m_height || snapshot->m_widths != m_widths)
+			{
+				ThrowException(L"Can't restore a snapshot of another terrain", ExceptionGravity::Warning);
+				return;
+			}
+			unsigned int chunks = m_chunksx * m_chunksy;
+			for (unsigned int i = 0; i < m_chunks.size(); i++)
+			{
+				if (m_chunks[i] != snapshot->m_chunks[i])
+				{
+					m_chunks[i] = snapshot->m_chunks[i];
+					m_owners[i] = snapshot->m_owners[i];
+					unsigned int x = i % chunks % m_chunksx * ChunkSize, y = i % chunks / m_chunksx * ChunkSize;
+					Touch(i / chunks, x, y, std::min(x + ChunkSize, m_width), std::min(y + ChunkSize, m_height));
+				}
+			}
+		}
+
+		//Returns the width of the terrain.
+		inline unsigned int GetWidth()
+		{
+			return m_width;
+		}
+
+		//Returns the height of the terrain.
+		inline unsigned int GetHeight()
+		{
+			return m_height;
+		}
+
+		//Returns the number of layers in the terrain.
+		inline unsigned int GetLayerCount()
+		{
+			return m_layers;
+		}
+
+		//Adds a light to the terrain lightmap. It fades out over range tiles and stops at the tiles of the wall layer. Mixed lights add up, the others keep the brightest light. Returns a handle to move, recolor or remove it.
+		inline unsigned int AddLight(unsigned int range, Color color, int x, int y, bool mixlights)
+		{
+			unsigned int id = m_light->AddLight(range, color, x, y, mixlights, Walls(range, x, y, m_walls));
+			TouchLights(x - (int)range - 1, y - (int)range - 1, x + (int)range + 1, y + (int)range + 1);
+			return id;
+		}
+
+		//Moves a light to another tile. Only the tiles it lit and the ones it lights now are updated. Returns false if the light doesn't exist.
+		bool MoveLight(unsigned int light, int x, int y)
+		{
+			int oldx, oldy;
+			unsigned int range;
+			if (!m_light->GetLight(light, oldx, oldy, range))
+				return false;
+			m_light->MoveLight(light, x, y, Walls(range, x, y, m_walls));
+			TouchLights(oldx - (int)range - 1, oldy - (int)range - 1, oldx + (int)range + 1, oldy + (int)range + 1);
+			TouchLights(x - (int)range - 1, y - (int)range - 1, x + (int)range + 1, y + (int)range + 1);
+			return true;
+		}
+
+		//Changes the color of a light. Returns false if the light doesn't exist.
+		bool SetLightColor(unsigned int light, Color color)
+		{
+			int x, y;
+			unsigned int range;
+			if (!m_light->GetLight(light, x, y, range))
+				return false;
+			m_light->SetLightColor(light, color);
+			TouchLights(x - (int)range - 1, y - (int)range - 1, x + (int)range + 1, y + (int)range + 1);
+			return true;
+		}
+
+		//Removes a light. Returns false if the light doesn't exist.
+		bool RemoveLight(unsigned int light)
+		{
+			int x, y;
+			unsigned int range;
+			if (!m_light->GetLight(light, x, y, range))
+				return false;
+			m_light->RemoveLight(light);
+			TouchLights(x - (int)range - 1, y - (int)range - 1, x + (int)range + 1, y + (int)range + 1);
+			return true;
+		}
+
+		//Sets the layer of light obstacles: every tile in it that isn't 0xffffffff stops lights. -1, the default, lets lights through everything. Lights already added don't change until they are moved.
+		inline void SetWallLayer(int layer)
+		{
+			m_wall = layer;
+		}
+
+		//Returns the layer of light obstacles, -1 if there is none.
+		inline int GetWallLayer()
+		{
+			return m_wall;
+		}
+
+		//DO NOT USE. 
+		inline LightMap* GetLightMap()
+		{
+			return m_light;
+		}
+
+		//DO NOT USE. Returns the light over a tile. Snapshots have no lights and are white.
+		inline Color GetLightColor(unsigned int x, unsigned int y)
+		{
+			return m_light ? m_light->GetTileColor(x, y) : Color(255, 255, 255);
+		}
+
+		//Spreads every light again against the current wall layer and rebuilds the light map on Hardware::GetThreadCount() threads. Use it after loading a terrain or changing many walls.
+		void Relight()
+		{
+			if (!m_light)
+				return;
+			std::vector<unsigned int> ids = m_light->GetLights();
+
+			//Each group of lights has its own scratch space, the lights only read the walls and write their own strengths
+			unsigned int groups = std::min<unsigned int>(ids.size(), Hardware::GetThreadCount() * 4);
+			Parallel(groups, [&](unsigned int group)
+			{
+				LightMap::Scratch scratch;
+				std::vector<unsigned int> walls;
+				for (size_t i = group; i < ids.size(); i += groups)
+				{
+					int x, y;
+					unsigned int range;
+					m_light->GetLight(ids[i], x, y, range);
+					m_light->Spread(ids[i], Walls(range, x, y, walls), scratch);
+				}
+			});
+
+			//Each band of ChunkSize rows is rebuilt by one thread from every light, always in the same order, so no tile is written twice and the result doesn't depend on the threads
+			Parallel(m_chunksy, [&](unsigned int band)
+			{
+				m_light->Rebuild(band * ChunkSize, (band + 1) * ChunkSize, ids);
+			});
+			TouchLights(0, 0, m_width, m_height);
+		}
+
+		//Changes the color of the tiles no light reaches, keeping the lights. The tiles are worked out again on Hardware::GetThreadCount() threads.
+		void SetLightBackColor(Color color)
+		{
+			if (!m_light)
+				return;
+			m_light->SetBackColor(color);
+			Parallel(m_chunksy, [&](unsigned int band)
+			{
+				m_light->Resolve(band * ChunkSize, (band + 1) * ChunkSize);
+			});
+			TouchLights(0, 0, m_width, m_height);
+		}
+
+		//Removes all lights, whose handles may be given to new lights, and fills the light map with a color.
+		inline void ResetLights(Color BackColor)
+		{
+			if (m_light)
+				delete m_light;
+			m_light = new LightMap(Size(m_width, m_height), BackColor);
+			TouchLights(0, 0, m_width, m_height);
+		}
+
+		//Sets how renderers draw this terrain. Chunks is the default.
+		inline void SetRenderingMode(TerrainRenderingMode mode)
+		{
+			m_mode = mode;
+		}
+
+		//Returns how renderers draw this terrain.
+		inline TerrainRenderingMode GetRenderingMode()
+		{
+			return m_mode;
+		}
+
+		//Calls a function once per changed layer every time DispatchChanges() is called. Returns an id for Unsubscribe().
+		unsigned int Subscribe(TerrainChangeCallback callback, void* userdata = NULL)
+		{
+			m_subscribers.push_back({ ++m_subscriberid, callback, userdata });
+			return m_subscriberid;
+		}
+
+		//Stops calling a function given to Subscribe().
+		void Unsubscribe(unsigned int id)
+		{
+			for (unsigned int i = 0; i < m_subscribers.size(); i++)
+			{
+				if (m_subscribers[i].id == id)
+				{
+					m_subscribers.erase(m_subscribers.begin() + i);
+					return;
+				}
+			}
+		}
+
+		//Call this once per frame. Sends the changes since the last call to the subscribers, then forgets them.
+		void DispatchChanges()
+		{
+			for (unsigned int l = 0; l < m_layers; l++)
+			{
+				TerrainChange& change = m_changes[l];
+				if (change.x1 >= change.x2)
+					continue;
+				//A subscriber can unsubscribe from its callback
+				std::vector<Subscriber> subscribers = m_subscribers;
+				for (Subscriber& subscriber : subscribers)
+					subscriber.callback(this, change, subscriber.userdata);
+				std::fill(m_dirty[l].begin(), m_dirty[l].end(), 0);
+				change.x1 = change.y1 = change.x2 = change.y2 = 0;
+			}
+		}
+
+		//Checks if a tile of a chunk changed since the last DispatchChanges().
+		inline bool IsChunkDirty(unsigned int layer, unsigned int cx, unsigned int cy)
+		{
+			return m_changes[layer].IsChunkDirty(cx, cy);
+		}
+
+		//Returns the number of chunk columns.
+		inline unsigned int GetChunkCountX()
+		{
+			return m_chunksx;
+		}
+
+		//Returns the number of chunk rows.
+		inline unsigned int GetChunkCountY()
+		{
+			return m_chunksy;
+		}
+
+		//DO NOT USE. Returns a counter that changes every time a tile of a chunk is modified.
+		inline unsigned int GetChunkVersion(unsigned int layer, unsigned int cx, unsigned int cy)
+		{
+			return m_versions[(layer * m_chunksy + cy) * m_chunksx + cx];
+		}
+
+		//DO NOT USE. Returns a counter that changes every time the lights over a chunk are modified.
+		inline unsigned int GetChunkLightVersion(unsigned int cx, unsigned int cy)
+		{
+			return m_lightversions[cy * m_chunksx + cx];
+		}
+
+		//DO NOT USE. Returns a counter that changes every time a light is modified anywhere.
+		inline unsigned int GetLightVersion()
+		{
+			return m_lightversion;
+		}
+
+		//DO NOT USE. Returns the chunk meshes of the terrain, creating them on the first call. Only call after Window::Create().
+		TerrainMesh* GetMesh();
+
+		//DO NOT USE. Returns the tile id textures of the terrain, creating them on the first call. Only call after Window::Create().
+		TerrainTileMap* GetTileMap();
+
+		//DO NOT USE. Returns the light map texture of the terrain, creating it on the first call. Only call after Window::Create().
+		TerrainLightTexture* GetLightTexture();
+
+		//Saves a terrain to a file. Lights will not be saved. Compressed files are much smaller but can't be mapped in memory when they are opened.
+		void SaveToFile(std::wstring filepath, bool compressed = false)
+		{
+			WaitForSave();
+			//The file this terrain is mapped from can't be written while it is open
+			if (m_mapping && filepath == m_path)
+				Detach();
+			//A new generation tells the journal of the old snapshot apart if the program stops before it is removed
+			unsigned long long generation = std::max((unsigned long long)std::chrono::system_clock::now().time_since_epoch().count(), m_generation + 1);
+			//The old snapshot stays whole until the new one is completely written
+			std::wstring temp = filepath + L".tmp";
+			unsigned long long size = compressed ? SaveCompressed(temp, generation) : SaveRaw(temp, generation);
+			if (size && !MoveOver(temp, filepath))
+			{
+				ThrowException(L"Error replacing terrain file " + filepath);
+				size = 0;
+			}
+			if (!size)
+			{
+				_wremove(temp.c_str());
+				if (m_task)
+					m_task->m_failed = true;
+				return;
+			}
+
+			//The journal of the file is part of the new snapshot
+			_wremove((filepath + L".journal").c_str());
+			m_journal = filepath;
+			m_generation = generation;
+			m_snapshotsize = size;
+			m_journalsize = 0;
+			m_saved = m_versions;
+		}
+
+		//Saves the chunks modified since the last save by appending them to filepath + ".journal". The first call, or a call with another file, saves the whole terrain.
+		//When the journal gets bigger than half the file, both are replaced by a new snapshot. The journal is applied when the file is opened.
+		void SaveChanges(std::wstring filepath, bool compressed = false)
+		{
+			WaitForSave();
+			if (filepath != m_journal || m_saved.size() != m_versions.size())
+			{
+				SaveToFile(filepath, compressed);
+				return;
+			}
+
+			std::wstring path = filepath + L".journal";
+			FILE* file = _wfopen(path.c_str(), L"ab");
+			if (file == NULL)
+			{
+				ThrowException(L"Error saving terrain journal " + path);
+				return;
+			}
+			bool ok = true;
+			if (m_journalsize == 0)
+			{
+				unsigned int header[7] = { JournalMagic, JournalVersion, m_width, m_height, m_layers, (unsigned int)m_generation, (unsigned int)(m_generation >> 32) };
+				ok = fwrite(header, 1, sizeof(header), file) == sizeof(header);
+				m_journalsize = sizeof(header);
+			}
+
+			//Each record is the index of a chunk, the size of its data and its compressed tiles
+			unsigned int chunks = m_chunksx * m_chunksy;
+			std::vector<unsigned char> data;
+			for (unsigned int i = 0; i < m_versions.size() && ok; i++)
+			{
+				if (m_versions[i] == m_saved[i])
+					continue;
+				TerrainCompression::EncodeChunk(m_chunks[i], ChunkSize * ChunkSize, m_widths[i / chunks], data);
+				unsigned int record[2] = { i, (unsigned int)data.size() };
+				ok = fwrite(record, 1, sizeof(record), file) == sizeof(record) && fwrite(data.data(), 1, data.size(), file) == data.size();
+				m_journalsize += sizeof(record) + data.size();
+				m_saved[i] = m_versions[i];
+			}
+			fclose(file);
+			if (!ok)
+			{
+				ThrowException(L"Error saving terrain journal " + path);
+				return;
+			}
+
+			if (m_journalsize > m_snapshotsize / 2)
+				SaveToFile(filepath, compressed);
+		}
+
+		~Terrain();
+
+	private:
+		friend class TerrainWorld;
+
+		//The start of each chunk, by layer, chunk row and chunk column
+		std::vector<unsigned char*> m_chunks;
+		//What keeps each chunk alive, one owner per chunk so its use count is the number of terrains sharing it. Chunks start in one block for the whole terrain and get their own memory when they are copied on write
+		std::vector<std::shared_ptr<unsigned char>> m_owners;
+		std::vector<TileIdWidth> m_widths;
+		//The file being opened by the constructor
+		IO::MappedFile* m_file = NULL;
+		//The mapped file the chunks point into, if any, and its path
+		std::shared_ptr<unsigned char> m_mapping;
+		std::wstring m_path;
+		//The file SaveChanges appends to, the chunk versions it last saved, the generation of the file and the sizes of the file and its journal
+		std::wstring m_journal;
+		std::vector<unsigned int> m_saved;
+		unsigned long long m_generation = 0, m_snapshotsize = 0, m_journalsize = 0;
+		LightMap* m_light;
+		//The layer that stops lights and the tiles of it around the last light placed
+		int m_wall = -1;
+		std::vector<unsigned int> m_walls;
+		unsigned int m_width, m_height, m_layers, m_chunksx, m_chunksy;
+		std::vector<unsigned int> m_versions, m_lightversions;
+		unsigned int m_lightversion = 0;
+		TerrainMesh* m_mesh = NULL;
+		TerrainTileMap* m_tilemap = NULL;
+		TerrainLightTexture* m_lighttexture = NULL;
+		TerrainRenderingMode m_mode = TerrainRenderingMode::Chunks;
+		//The task loading or saving this terrain on a worker thread, if any
+		TerrainTask* m_task = NULL;
+		//Ready once the last SaveAsync() of this terrain is written
+		std::shared_future<void> m_saving;
+
+		struct Subscriber
+		{
+			unsigned int id;
+			TerrainChangeCallback callback;
+			void* userdata;
+		};
+		std::vector<Subscriber> m_subscribers;
+		unsigned int m_subscriberid = 0;
+		//The changes of every layer since the last DispatchChanges(), with their chunk bitsets
+		std::vector<TerrainChange> m_changes;
+		std::vector<std::vector<unsigned long long>> m_dirty;
+
+		Terrain(std::wstring filepath, Color LightmapBackcolor, TerrainTask* task)
+		{
+			m_task = task;
+			m_width = m_height = m_layers = 0;
+			m_file = new IO::MappedFile(filepath);
+			m_path = filepath;
+			unsigned int magic = 0, version = 1;
+			unsigned long long filesize = m_file->GetSize();
+			if (m_file->GetSize() >= 8)
+			{
+				memcpy(&magic, m_file->GetData(), 4);
+				if (magic == FileMagic)
+					memcpy(&version, m_file->GetData() + 4, 4);
+			}
+
+			bool valid = m_file->GetData() && (version == FileVersion ? Map() : version == CompressedVersion ? Decompress() : Convert(version));
+			if (!valid || version != FileVersion)
+			{
+				delete m_file;
+				m_file = NULL;
+			}
+			if (!valid)
+			{
+				ThrowException(L"Corrupted terrain file " + filepath);
+				if (task)
+					task->m_failed = true;
+				m_width = m_height = m_layers = 0;
+				m_widths.clear();
+				CreateStorage();
+			}
+			else
+			{
+				m_snapshotsize = filesize;
+				ApplyJournal(filepath);
+			}
+			m_light = new LightMap(Size(m_width, m_height), LightmapBackcolor);
+			//A mapped file is deleted with the last chunk using it
+			m_file = NULL;
+			m_task = NULL;
+		}
+
+		//Moves a file over another one in a single step.
+		static bool MoveOver(std::wstring from, std::wstring to)
+		{
+#ifdef _WINDOWS_
+			return MoveFileExW(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+			return std::rename(StringTools::ToString(from).c_str(), StringTools::ToString(to).c_str()) == 0;
+#endif
+		}
+
+		//Waits for the last SaveAsync() so two saves never write the same file at once.
+		inline void WaitForSave()
+		{
+			if (m_saving.valid())
+				m_saving.wait();
+		}
+
+		inline void Progress(float value)
+		{
+			if (m_task)
+				m_task->m_progress = value;
+		}
+
+		//Creates the chunk table. Without a base, the storage is allocated. Otherwise the chunks point into the mapped file, each layer starting at base + its offset.
+		void CreateStorage(unsigned char* base = NULL, const unsigned long long* offsets = NULL)
+		{
+			CreateTables();
+			if (!base)
+			{
+				Allocate();
+				return;
+			}
+			IO::MappedFile* file = m_file;
+			m_mapping = std::shared_ptr<unsigned char>(base, [file](unsigned char*) { delete file; });
+			size_t chunks = m_chunksx * m_chunksy;
+			m_chunks = std::vector<unsigned char*>(chunks * m_layers);
+			m_owners = std::vector<std::shared_ptr<unsigned char>>(chunks * m_layers);
+			for (size_t i = 0; i < m_chunks.size(); i++)
+			{
+				m_chunks[i] = base + offsets[i / chunks] + (i % chunks) * ChunkSize * ChunkSize * m_widths[i / chunks];
+				m_owners[i] = Own(m_chunks[i], m_mapping);
+			}
+		}
+
+		//An owner of its own for a chunk inside a block. It keeps the block alive but counts only the terrains sharing this chunk.
+		static inline std::shared_ptr<unsigned char> Own(unsigned char* chunk, std::shared_ptr<unsigned char> block)
+		{
+			return std::shared_ptr<unsigned char>(chunk, [block](unsigned char*) {});
+		}
+
+		//Returns the number of chunks along a side of size tiles, without overflowing near the largest sizes.
+		static inline unsigned long long ChunkCount(unsigned int size)
+		{
+			return ((unsigned long long)size + ChunkSize - 1) / ChunkSize;
+		}
+
+		//Checks that the chunks of a terrain can be indexed with an unsigned int and that its tiles can be allocated.
+		static bool Fits(unsigned int width, unsigned int height, unsigned int layers)
+		{
+			unsigned long long chunks = ChunkCount(width) * ChunkCount(height);
+			if (layers && chunks > 0xFFFFFFFFull / layers)
+				return false;
+			return chunks * layers * ChunkSize * ChunkSize * TileIdWidth::TileId32 <= (size_t)-1;
+		}
+
+		//Creates the chunk versions and the change tracking.
+		void CreateTables()
+		{
+			m_chunksx = (unsigned int)ChunkCount(m_width);
+			m_chunksy = (unsigned int)ChunkCount(m_height);
+			m_versions = std::vector<unsigned int>(m_chunksx * m_chunksy * m_layers, 0);
+			m_lightversions = std::vector<unsigned int>(m_chunksx * m_chunksy, 0);
+			m_dirty = std::vector<std::vector<unsigned long long>>(m_layers, std::vector<unsigned long long>((m_chunksx * m_chunksy + 63) / 64 + 1, 0));
+			m_changes = std::vector<TerrainChange>(m_layers);
+			for (unsigned int l = 0; l < m_layers; l++)
+				m_changes[l] = { l, 0, 0, 0, 0, m_dirty[l].data(), m_chunksx };
+		}
+
+		void Allocate()
+		{
+			//One allocation for the whole terrain, each layer taking as many bytes per tile as its width
+			size_t size = 0, chunks = m_chunksx * m_chunksy;
+			for (unsigned int l = 0; l < m_layers; l++)
+				size += chunks * ChunkSize * ChunkSize * m_widths[l];
+			std::shared_ptr<unsigned char> block(new unsigned char[size](), std::default_delete<unsigned char[]>());
+			m_chunks = std::vector<unsigned char*>(chunks * m_layers);
+			m_owners = std::vector<std::shared_ptr<unsigned char>>(chunks * m_layers);
+			unsigned char* start = block.get();
+			for (size_t i = 0; i < m_chunks.size(); i++)
+			{
+				m_chunks[i] = start;
+				m_owners[i] = Own(start, block);
+				start += ChunkSize * ChunkSize * m_widths[i / chunks];
+			}
+		}
+
+		//Points the chunks at a file of the current version. Its header has the size, the layer count, the chunk size, the generation and the width and offset of every layer.
+		bool Map()
+		{
+			unsigned char* data = m_file->GetData();
+			unsigned long long size = m_file->GetSize();
+			unsigned int chunksize = 0, header = 32;
+			if (size < header)
+				return false;
+			memcpy(&m_width, data + 8, 4);
+			memcpy(&m_height, data + 12, 4);
+			memcpy(&m_layers, data + 16, 4);
+			memcpy(&chunksize, data + 20, 4);
+			memcpy(&m_generation, data + 24, 8);
+			if (chunksize != ChunkSize || size < header + (unsigned long long)m_layers * 16 || !Fits(m_width, m_height, m_layers))
+				return false;
+
+			unsigned long long chunks = ChunkCount(m_width) * ChunkCount(m_height);
+			std::vector<unsigned long long> offsets(m_layers);
+			for (unsigned int l = 0; l < m_layers; l++)
+			{
+				unsigned int width;
+				memcpy(&width, data + header + l * 16, 4);
+				memcpy(&offsets[l], data + header + l * 16 + 8, 8);
+				if ((width != TileIdWidth::TileId8 && width != TileIdWidth::TileId16 && width != TileIdWidth::TileId32) || offsets[l] % width
+					|| offsets[l] > size || size - offsets[l] < chunks * ChunkSize * ChunkSize * width)
+					return false;
+				m_widths.push_back((TileIdWidth)width);
+			}
+			CreateStorage(data, offsets.data());
+			return true;
+		}
+
+		//Copies a file of version 1 to the storage. It has the size and the layer count, then the 32 bit tiles of every layer, column after column.
+		bool Convert(unsigned int version)
+		{
+			const unsigned char* buffer = m_file->GetData();
+			unsigned long long filesize = m_file->GetSize(), header = 12;
+			if (version != 1 || filesize < header)
+				return false;
+			memcpy(&m_width, buffer, 4);
+			memcpy(&m_height, buffer + 4, 4);
+			memcpy(&m_layers, buffer + 8, 4);
+			if (!Fits(m_width, m_height, m_layers) || filesize < header + (unsigned long long)m_width * m_height * m_layers * TileIdWidth::TileId32)
+				return false;
+			m_widths = std::vector<TileIdWidth>(m_layers, TileIdWidth::TileId32);
+
+			CreateStorage();
+			//The tiles are read in order and written down the columns of the chunks
+			const unsigned char* src = buffer + header;
+			for (unsigned int l = 0; l < m_layers; l++)
+			{
+				unsigned int bytes = m_widths[l];
+				for (unsigned int x = 0; x < m_width; x++)
+				{
+					if (x % 256 == 0)
+						Progress((l + x / (float)m_width) / m_layers);
+					for (unsigned int y = 0; y < m_height; y += ChunkSize)
+					{
+						unsigned char* dst = Chunk(l, x, y) + (x & ChunkMask) * bytes;
+						unsigned int count = std::min(ChunkSize, m_height - y);
+						for (unsigned int i = 0; i < count; i++, src += bytes)
+							memcpy(dst + (i << ChunkShift) * bytes, src, bytes);
+					}
+				}
+			}
+			return true;
+		}
+
+		//Writes the current version. The header is followed by every layer, each stored as its chunks are in memory. Returns the size of the file, or 0 if it failed.
+		unsigned long long SaveRaw(std::wstring filepath, unsigned long long generation)
+		{
+			unsigned int chunks = m_chunksx * m_chunksy;
+			std::vector<unsigned char> header(32 + m_layers * 16, 0);
+			unsigned int values[6] = { FileMagic, FileVersion, m_width, m_height, m_layers, ChunkSize };
+			memcpy(header.data(), values, sizeof(values));
+			memcpy(&header[24], &generation, 8);
+			std::vector<unsigned long long> offsets(m_layers);
+			unsigned long long offset = header.size();
+			for (unsigned int l = 0; l < m_layers; l++)
+			{
+				offset = (offset + 63) / 64 * 64;
+				offsets[l] = offset;
+				unsigned int width = m_widths[l];
+				memcpy(&header[32 + l * 16], &width, 4);
+				memcpy(&header[32 + l * 16 + 8], &offset, 8);
+				offset += (unsigned long long)chunks * ChunkSize * ChunkSize * width;
+			}
+
+			FILE* file = _wfopen(filepath.c_str(), L"wb");
+			if (file == NULL)
+			{
+				ThrowException(L"Error saving terrain file " + filepath);
+				return 0;
+			}
+			bool ok = fwrite(header.data(), 1, header.size(), file) == header.size();
+			unsigned long long position = header.size();
+			const unsigned char padding[64] = { 0 };
+			for (unsigned int l = 0; l < m_layers && ok; l++)
+			{
+				size_t bytes = (size_t)ChunkSize * ChunkSize * m_widths[l];
+				ok = fwrite(padding, 1, offsets[l] - position, file) == offsets[l] - position;
+				//Chunk by chunk because chunks copied on write are no longer next to the others
+				for (unsigned int i = 0; i < chunks && ok; i++)
+				{
+					ok = fwrite(m_chunks[l * chunks + i], 1, bytes, file) == bytes;
+					if (i % 1024 == 1023)
+						Progress((offsets[l] + (i + 1) * bytes) / (float)offset);
+				}
+				position = offsets[l] + chunks * bytes;
+			}
+			fclose(file);
+			if (!ok)
+				ThrowException(L"Error saving terrain file " + filepath);
+			return ok ? position : 0;
+		}
+
+		//Compresses every chunk and writes them as they are ready, a few per thread at a time. The header has the size, the layer count, the chunk size, the generation, the width of every layer and the offset and size of every chunk.
+		unsigned long long SaveCompressed(std::wstring filepath, unsigned long long generation)
+		{
+			size_t total = m_chunks.size(), chunks = m_chunksx * m_chunksy;
+			std::vector<unsigned char> header(32 + m_layers * 4, 0);
+			unsigned int values[6] = { FileMagic, CompressedVersion, m_width, m_height, m_layers, ChunkSize };
+			memcpy(header.data(), values, sizeof(values));
+			memcpy(&header[24], &generation, 8);
+			for (unsigned int l = 0; l < m_layers; l++)
+			{
+				unsigned int width = m_widths[l];
+				memcpy(&header[32 + l * 4], &width, 4);
+			}
+			std::vector<unsigned char> table(total * 12, 0);
+
+			FILE* file = _wfopen(filepath.c_str(), L"wb");
+			if (file == NULL)
+			{
+				ThrowException(L"Error saving terrain file " + filepath);
+				return 0;
+			}
+			bool ok = fwrite(header.data(), 1, header.size(), file) == header.size() && fwrite(table.data(), 1, table.size(), file) == table.size();
+			unsigned long long offset = header.size() + table.size();
+
+			//The same threads compress every chunk. Each chunk has a slot until it is written, and the thread that fills the slot of the next chunk to write writes it and the ready ones after it, so the file stays in order.
+			size_t slots = Hardware::GetThreadCount() * 16, written = 0;
+			std::vector<std::vector<unsigned char>> blobs(slots);
+			std::vector<char> ready(slots, 0);
+			std::mutex mutex;
+			std::condition_variable space;
+			Parallel((unsigned int)total, [&](unsigned int i)
+			{
+				bool encode;
+				{
+					//A thread doesn't get more than the number of slots ahead of the writing
+					std::unique_lock<std::mutex> lock(mutex);
+					space.wait(lock, [&]() { return i < written + slots; });
+					encode = ok;
+				}
+				std::vector<unsigned char>& blob = blobs[i % slots];
+				if (encode)
+					TerrainCompression::EncodeChunk(m_chunks[i], ChunkSize * ChunkSize, m_widths[i / chunks], blob);
+
+				std::lock_guard<std::mutex> lock(mutex);
+				ready[i % slots] = 1;
+				for (; written < total && ready[written % slots]; written++)
+				{
+					std::vector<unsigned char>& next = blobs[written % slots];
+					ready[written % slots] = 0;
+					if (!ok)
+						continue;
+					unsigned int size = next.size();
+					memcpy(&table[written * 12], &offset, 8);
+					memcpy(&table[written * 12 + 8], &size, 4);
+					ok = fwrite(next.data(), 1, size, file) == size;
+					offset += size;
+					if (written % 1024 == 1023)
+						Progress((written + 1) / (float)total);
+				}
+				space.notify_all();
+			});
+			Progress(1);
+
+			//The table is known once every chunk is written
+			ok = ok && fseek(file, (long)header.size(), SEEK_SET) == 0 && fwrite(table.data(), 1, table.size(), file) == table.size();
+			fclose(file);
+			if (!ok)
+				ThrowException(L"Error saving terrain file " + filepath);
+			return ok ? offset : 0;
+		}
+
+		//Decompresses the chunks of a compressed file in parallel. Its header is the one of the raw files with only the width of every layer, followed by the offset and size of every chunk.
+		bool Decompress()
+		{
+			const unsigned char* data = m_file->GetData();
+			unsigned long long size = m_file->GetSize();
+			unsigned int chunksize = 0, header = 32;
+			if (size < header)
+				return false;
+			memcpy(&m_width, data + 8, 4);
+			memcpy(&m_height, data + 12, 4);
+			memcpy(&m_layers, data + 16, 4);
+			memcpy(&chunksize, data + 20, 4);
+			memcpy(&m_generation, data + 24, 8);
+			if (chunksize != ChunkSize || size < header + (unsigned long long)m_layers * 4 || !Fits(m_width, m_height, m_layers))
+				return false;
+			for (unsigned int l = 0; l < m_layers; l++)
+			{
+				unsigned int width;
+				memcpy(&width, data + header + l * 4, 4);
+				if (width != TileIdWidth::TileId8 && width != TileIdWidth::TileId16 && width != TileIdWidth::TileId32)
+					return false;
+				m_widths.push_back((TileIdWidth)width);
+			}
+
+			unsigned long long chunks = ChunkCount(m_width) * ChunkCount(m_height);
+			const unsigned char* table = data + header + m_layers * 4;
+			if (size - (table - data) < chunks * m_layers * 12)
+				return false;
+
+			CreateStorage();
+			std::atomic<bool> valid{ true };
+			std::atomic<unsigned int> done{ 0 };
+			Parallel(m_chunks.size(), [&](unsigned int i)
+			{
+				if (++done % 256 == 0)
+					Progress(done / (float)m_chunks.size());
+				unsigned long long offset;
+				unsigned int length;
+				memcpy(&offset, table + i * 12, 8);
+				memcpy(&length, table + i * 12 + 8, 4);
+				if (offset > size || size - offset < length
+					|| !TerrainCompression::DecodeChunk(data + offset, length, m_chunks[i], ChunkSize * ChunkSize, m_widths[i / chunks]))
+					valid = false;
+			});
+			return valid;
+		}
+
+		//Runs a function for every index from 0 to count on Hardware::GetThreadCount() threads.
+		template<typename F>
+		static void Parallel(unsigned int count, F function)
+		{
+			unsigned int threads = std::min(Hardware::GetThreadCount(), count);
+			std::atomic<unsigned int> next{ 0 };
+			auto work = [&]()
+			{
+				for (unsigned int i = next++; i < count; i = next++)
+					function(i);
+			};
+			std::vector<std::thread> workers;
+			for (unsigned int t = 1; t < threads; t++)
+				workers.push_back(std::thread(work));
+			work();
+			for (auto& worker : workers)
+				worker.join();
+		}
+
+		//Applies the records of the journal of a file. A record cut short by a crash ends the journal.
+		//A journal written for another generation of the file, left by a crash while it was replaced, is ignored.
+		void ApplyJournal(std::wstring filepath)
+		{
+			m_journal = filepath;
+			m_saved = m_versions;
+			FILE* file = _wfopen((filepath + L".journal").c_str(), L"rb");
+			if (file == NULL)
+				return;
+
+			unsigned int header[7] = { 0, 0, 0, 0, 0, 0, 0 };
+			bool valid = fread(header, 1, sizeof(header), file) == sizeof(header) && header[0] == JournalMagic && header[1] == JournalVersion;
+			unsigned long long generation = header[5] | (unsigned long long)header[6] << 32;
+			if (!valid || generation != m_generation || header[2] != m_width || header[3] != m_height || header[4] != m_layers)
+			{
+				fclose(file);
+				ThrowException(L"Corrupted terrain journal " + filepath + L".journal", ExceptionGravity::Warning);
+				//The next SaveChanges writes a new snapshot instead of appending to it
+				m_journal.clear();
+				return;
+			}
+			m_journalsize = sizeof(header);
+
+			unsigned int chunks = m_chunksx * m_chunksy, record[2];
+			//A record is decoded aside so a broken one leaves its chunk as it was
+			std::vector<unsigned char> data, tiles(ChunkSize * ChunkSize * TileIdWidth::TileId32);
+			size_t read;
+			while ((read = fread(record, 1, sizeof(record), file)) == sizeof(record) && record[0] < m_chunks.size())
+			{
+				unsigned int width = m_widths[record[0] / chunks];
+				if (record[1] > TerrainCompression::MaxEncodedSize(ChunkSize * ChunkSize, width))
+					break;
+				data.resize(record[1]);
+				if (fread(data.data(), 1, data.size(), file) != data.size()
+					|| !TerrainCompression::DecodeChunk(data.data(), data.size(), tiles.data(), ChunkSize * ChunkSize, width))
+				{
+					read = 1;
+					break;
+				}
+				memcpy(m_chunks[record[0]], tiles.data(), ChunkSize * ChunkSize * width);
+				m_journalsize += sizeof(record) + data.size();
+			}
+			fclose(file);
+			//Records appended after a broken one would never be read
+			if (read)
+				m_journal.clear();
+		}
+
+		//Copies the mapped tiles to memory and closes the file.
+		void Detach()
+		{
+			std::vector<unsigned char*> mapped = m_chunks;
+			std::vector<std::shared_ptr<unsigned char>> owners = m_owners;
+			Allocate();
+			unsigned int chunks = m_chunksx * m_chunksy;
+			for (size_t i = 0; i < m_chunks.size(); i++)
+				memcpy(m_chunks[i], mapped[i], ChunkSize * ChunkSize * m_widths[i / chunks]);
+			m_mapping.reset();
+		}
+
+		//Returns a chunk that can be written. A chunk another terrain shares is copied first.
+		inline unsigned char* WritableChunk(unsigned int index)
+		{
+			if (m_owners[index].use_count() > 1)
+			{
+				unsigned int bytes = ChunkSize * ChunkSize * m_widths[index / (m_chunksx * m_chunksy)];
+				std::shared_ptr<unsigned char> copy(new unsigned char[bytes], std::default_delete<unsigned char[]>());
+				memcpy(copy.get(), m_chunks[index], bytes);
+				m_chunks[index] = copy.get();
+				m_owners[index] = copy;
+			}
+			return m_chunks[index];
+		}
+
+		//Marks the tiles from x1, y1 to x2, y2 (excluded) of a layer as changed.
+		void Touch(unsigned int layer, unsigned int x1, unsigned int y1, unsigned int x2, unsigned int y2)
+		{
+			if (x1 >= x2 || y1 >= y2)
+				return;
+			unsigned int chunks = m_chunksx * m_chunksy;
+			for (unsigned int cy = y1 >> ChunkShift; cy <= (y2 - 1) >> ChunkShift; cy++)
+			{
+				for (unsigned int cx = x1 >> ChunkShift; cx <= (x2 - 1) >> ChunkShift; cx++)
+				{
+					unsigned int i = cy * m_chunksx + cx;
+					m_versions[layer * chunks + i]++;
+					m_dirty[layer][i >> 6] |= 1ull << (i & 63);
+				}
+			}
+
+			TerrainChange& change = m_changes[layer];
+			if (change.x1 >= change.x2)
+			{
+				change.x1 = x1;
+				change.y1 = y1;
+				change.x2 = x2;
+				change.y2 = y2;
+			}
+			else
+			{
+				change.x1 = std::min(change.x1, x1);
+				change.y1 = std::min(change.y1, y1);
+				change.x2 = std::max(change.x2, x2);
+				change.y2 = std::max(change.y2, y2);
+			}
+		}
+
+		//Tile read without bounds checks
+		inline unsigned int Read(unsigned int layer, unsigned int x, unsigned int y)
+		{
+			return ReadTile(Chunk(layer, x, y), m_widths[layer], ((y & ChunkMask) << ChunkShift) + (x & ChunkMask));
+		}
+
+		//Calls a function with the tiles of every chunk row a rectangle covers. The chunk version goes up when the function returns true.
+		template<typename F>
+		inline void ForEachSpan(unsigned int layer, int x, int y, Size size, F function)
+		{
+			ForEachSpan(layer, x, y, size, function, [](const unsigned char*, unsigned int) { return true; });
+		}
+
+		//Same, but the rows of a chunk shared with a snapshot are first read where they are, and the chunk is only copied for the ones check returns true for.
+		template<typename F, typename C>
+		void ForEachSpan(unsigned int layer, int x, int y, Size size, F function, C check)
+		{
+			if (layer >= m_layers)
+				return;
+			int x1 = std::max(x, 0), y1 = std::max(y, 0);
+			int x2 = (int)std::min((long long)x + size.width, (long long)m_width), y2 = (int)std::min((long long)y + size.height, (long long)m_height);
+			unsigned int bytes = m_widths[layer];
+			for (int ty = y1; ty < y2; ty++)
+			{
+				for (int tx = x1; tx < x2;)
+				{
+					unsigned int n = std::min(ChunkSize - (tx & ChunkMask), (unsigned int)(x2 - tx));
+					unsigned int index = ChunkIndex(layer, tx, ty), offset = (((ty & ChunkMask) << ChunkShift) + (tx & ChunkMask)) * bytes;
+					if ((m_owners[index].use_count() == 1 || check(m_chunks[index] + offset, n)) && function(WritableChunk(index) + offset, n))
+						Touch(layer, tx, ty, tx + n, ty + 1);
+					tx += n;
+				}
+			}
+		}
+
+		//The way a tile id is stored in a layer. Returns false if it doesn't fit and isn't 0xffffffff.
+		static inline bool Encode(TileIdWidth width, unsigned int value, unsigned int& stored)
+		{
+			unsigned int empty = width == TileIdWidth::TileId8 ? 0xff : width == TileIdWidth::TileId16 ? 0xffff : 0xffffffff;
+			stored = value > empty ? empty : value;
+			return value <= empty || value == 0xffffffff;
+		}
+
+		static inline unsigned int CountBits(unsigned int value)
+		{
+			unsigned int count = 0;
+			for (; value; value &= value - 1)
+				count++;
+			return count;
+		}
+
+		//Sets count tiles to a value, 16 bytes at a time with SSE2.
+		static void FillTiles(unsigned char* tiles, TileIdWidth width, unsigned int count, unsigned int value)
+		{
+			Encode(width, value, value);
+			size_t bytes = (size_t)count * width, i = 0;
+#ifdef GIZEGO_SSE2
+			__m128i v = width == TileIdWidth::TileId8 ? _mm_set1_epi8((char)value) : width == TileIdWidth::TileId16 ? _mm_set1_epi16((short)value) : _mm_set1_epi32((int)value);
+			for (; i + 16 <= bytes; i += 16)
+				_mm_storeu_si128((__m128i*)(tiles + i), v);
+#endif
+			for (; i < bytes; i += width)
+				memcpy(tiles + i, &value, width);
+		}
+
+		//Checks if count tiles hold a value.
+		static bool HasTile(const unsigned char* tiles, TileIdWidth width, unsigned int count, unsigned int value)
+		{
+			if (!Encode(width, value, value))
+				return false;
+			for (size_t i = 0, bytes = (size_t)count * width; i < bytes; i += width)
+				if (!memcmp(tiles + i, &value, width))
+					return true;
+			return false;
+		}
+
+		//Replaces a tile by another in count tiles, 16 bytes at a time with SSE2. Returns the number of tiles replaced.
+		static unsigned int ReplaceTiles(unsigned char* tiles, TileIdWidth width, unsigned int count, unsigned int from, unsigned int to)
+		{
+			if (!Encode(width, from, from))
+				return 0;
+			Encode(width, to, to);
+			size_t bytes = (size_t)count * width, i = 0;
+			unsigned int replaced = 0;
+#ifdef GIZEGO_SSE2
+			__m128i f, t;
+			switch (width)
+			{
+			case TileIdWidth::TileId8:
+				f = _mm_set1_epi8((char)from);
+				t = _mm_set1_epi8((char)to);
+				break;
+			case TileIdWidth::TileId16:
+				f = _mm_set1_epi16((short)from);
+				t = _mm_set1_epi16((short)to);
+				break;
+			default:
+				f = _mm_set1_epi32((int)from);
+				t = _mm_set1_epi32((int)to);
+			}
+			for (; i + 16 <= bytes; i += 16)
+			{
+				__m128i d = _mm_loadu_si128((__m128i*)(tiles + i));
+				__m128i m = width == TileIdWidth::TileId8 ? _mm_cmpeq_epi8(d, f) : width == TileIdWidth::TileId16 ? _mm_cmpeq_epi16(d, f) : _mm_cmpeq_epi32(d, f);
+				unsigned int mask = _mm_movemask_epi8(m);
+				if (!mask)
+					continue;
+				_mm_storeu_si128((__m128i*)(tiles + i), _mm_or_si128(_mm_and_si128(m, t), _mm_andnot_si128(m, d)));
+				//The mask has a bit per byte
+				replaced += CountBits(mask) / width;
+			}
+#endif
+			for (; i < bytes; i += width)
+			{
+				if (!memcmp(tiles + i, &from, width))
+				{
+					memcpy(tiles + i, &to, width);
+					replaced++;
+				}
+			}
+			return replaced;
+		}
+
+		static inline unsigned int ReadTile(const unsigned char* chunk, TileIdWidth width, unsigned int i)
+		{
+			switch (width)
+			{
+			case TileIdWidth::TileId8:
+				return chunk[i] == 0xff ? 0xffffffff : chunk[i];
+			case TileIdWidth::TileId16:
+				return ((const unsigned short*)chunk)[i] == 0xffff ? 0xffffffff : ((const unsigned short*)chunk)[i];
+			default:
+				return ((const unsigned int*)chunk)[i];
+			}
+		}
+
+		static inline void WriteTile(unsigned char* chunk, TileIdWidth width, unsigned int i, unsigned int value)
+		{
+			switch (width)
+			{
+			case TileIdWidth::TileId8:
+				chunk[i] = value > 0xff ? 0xff : value;
+				break;
+			case TileIdWidth::TileId16:
+				((unsigned short*)chunk)[i] = value > 0xffff ? 0xffff : value;
+				break;
+			default:
+				((unsigned int*)chunk)[i] = value;
+			}
+		}
+
+		//Narrow ids are widened with their biggest value turned into 0xffffffff so empty tiles stay empty.
+		template<typename T>
+		static inline void Widen(const T* src, unsigned int* dst, unsigned int count)
+		{
+			const T empty = (T)~0;
+			for (unsigned int i = 0; i < count; i++)
+				dst[i] = src[i] == empty ? 0xffffffff : src[i];
+		}
+
+		template<typename T>
+		static inline void Narrow(const unsigned int* src, T* dst, unsigned int count)
+		{
+			const T empty = (T)~0;
+			for (unsigned int i = 0; i < count; i++)
+				dst[i] = src[i] > empty ? empty : (T)src[i];
+		}
+
+		inline unsigned int ChunkIndex(unsigned int layer, unsigned int x, unsigned int y)
+		{
+			return (layer * m_chunksy + (y >> ChunkShift)) * m_chunksx + (x >> ChunkShift);
+		}
+
+		//The chunk of a tile
+		inline unsigned char* Chunk(unsigned int layer, unsigned int x, unsigned int y)
+		{
+			return m_chunks[ChunkIndex(layer, x, y)];
+		}
+
+		//The tiles of the wall layer around a light, NULL if there is no wall layer
+		const unsigned int* Walls(unsigned int range, int x, int y, std::vector<unsigned int>& walls)
+		{
+			if (m_wall < 0 || (unsigned int)m_wall >= m_layers)
+				return NULL;
+			walls.resize((2 * range + 1) * (2 * range + 1));
+			GetRegion(m_wall, x - (int)range, y - (int)range, Size(2 * range + 1, 2 * range + 1), walls.data());
+			return walls.data();
+		}
+
+		//Marks the chunks touching a tile rectangle as having their lights changed.
+		void TouchLights(int x1, int y1, int x2, int y2)
+		{
+			int cx1 = std::max(x1, 0) / (int)ChunkSize, cy1 = std::max(y1, 0) / (int)ChunkSize;
+			int cx2 = std::min(x2 / (int)ChunkSize, (int)m_chunksx - 1), cy2 = std::min(y2 / (int)ChunkSize, (int)m_chunksy - 1);
+			for (int cy = cy1; cy <= cy2; cy++)
+				for (int cx = cx1; cx <= cx2; cx++)
+					m_lightversions[cy * m_chunksx + cx]++;
+			m_lightversion++;
+		}
+	};
+	
+	//DO NOT USE. This is integrated in the terrain class. Keeps the light map in a texture that the shaders sample with bilinear filtering, so lights cost nothing per draw and fade smoothly from tile to tile.
+	//A terrain bigger than the maximum texture size only keeps the area around the camera in it, moved when the camera gets out of it.
+	class TerrainLightTexture
+	{
+	public:
+		//DO NOT USE. This is integrated in the terrain class.
+		TerrainLightTexture(Terrain* ter)
+		{
+			m_terrain = ter;
+			if (!ter->GetWidth() || !ter->GetHeight())
+				return;
+
+			int max;
+			glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max);
+			m_width = std::min(ter->GetWidth(), (unsigned int)max);
+			m_height = std::min(ter->GetHeight(), (unsigned int)max);
+
+			glGenTextures(1, &m_texture);
+			Bindings::BindTexture(m_texture);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, m_width, m_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+			m_versions = std::vector<unsigned int>(ter->GetChunkCountX() * ter->GetChunkCountY());
+			Reload();
+		}
+
+		~TerrainLightTexture()
+		{
+			if (m_texture)
+				glDeleteTextures(1, &m_texture);
+			Bindings::s_tex = 0;
+		}
+
+		//DO NOT USE. Moves the texture over what a camera sees if it is smaller than the terrain, uploads the chunks whose lights changed, merging the neighbours of a chunk row, and returns the texture.
+		unsigned int Update(Camera* cam, unsigned int tilesize)
+		{
+			if (!m_texture)
+				return 0;
+			if (m_width < m_terrain->GetWidth() || m_height < m_terrain->GetHeight())
+			{
+				//The tiles the camera sees, clamped to the terrain
+				long long x1 = std::max((long long)std::floor(cam->GetX() / (double)tilesize) - 1, 0ll), y1 = std::max((long long)std::floor(cam->GetY() / (double)tilesize) - 1, 0ll);
+				long long x2 = std::min(x1 + cam->GetWidth() + 2, (long long)m_terrain->GetWidth()), y2 = std::min(y1 + cam->GetHeight() + 2, (long long)m_terrain->GetHeight());
+				if (x1 < m_x || y1 < m_y || x2 > m_x + m_width || y2 > m_y + m_height)
+				{
+					m_x = (unsigned int)std::max(0ll, std::min((x1 + x2 - m_width) / 2, (long long)(m_terrain->GetWidth() - m_width)));
+					m_y = (unsigned int)std::max(0ll, std::min((y1 + y2 - m_height) / 2, (long long)(m_terrain->GetHeight() - m_height)));
+					Reload();
+					return m_texture;
+				}
+			}
+			if (m_version == m_terrain->GetLightVersion())
+				return m_texture;
+			m_version = m_terrain->GetLightVersion();
+
+			//The chunks out of the texture are uploaded with the rest of it when it moves
+			unsigned int chx = m_terrain->GetChunkCountX(), cs = Terrain::ChunkSize;
+			for (unsigned int cy = 0; cy < m_terrain->GetChunkCountY(); cy++)
+			{
+				for (unsigned int cx = 0; cx < chx; cx++)
+				{
+					unsigned int first = cx;
+					for (; cx < chx && m_versions[cy * chx + cx] != m_terrain->GetChunkLightVersion(cx, cy); cx++)
+						m_versions[cy * chx + cx] = m_terrain->GetChunkLightVersion(cx, cy);
+					if (cx == first)
+						continue;
+					unsigned int x1 = std::max(first * cs, m_x), y1 = std::max(cy * cs, m_y);
+					unsigned int x2 = std::min(cx * cs, m_x + m_width), y2 = std::min((cy + 1) * cs, m_y + m_height);
+					if (x1 < x2 && y1 < y2)
+						Upload(x1, y1, x2 - x1, y2 - y1);
+				}
+			}
+			return m_texture;
+		}
+
+		//DO NOT USE. Returns the first column of tiles in the texture.
+		inline unsigned int GetX() { return m_x; }
+		//DO NOT USE. Returns the first row of tiles in the texture.
+		inline unsigned int GetY() { return m_y; }
+		//DO NOT USE. Returns how many columns of tiles the texture holds.
+		inline unsigned int GetWidth() { return m_width; }
+		//DO NOT USE. Returns how many rows of tiles the texture holds.
+		inline unsigned int GetHeight() { return m_height; }
+
+	private:
+		Terrain* m_terrain;
+		unsigned int m_texture = 0, m_version = 0;
+		//The area of the terrain in the texture, in tiles
+		unsigned int m_x = 0, m_y = 0, m_width = 0, m_height = 0;
+		std::vector<unsigned int> m_versions;
+		std::vector<Color> m_white;
+
+		//Uploads the whole area of the texture and marks every chunk as up to date.
+		void Reload()
+		{
+			Upload(m_x, m_y, m_width, m_height);
+			for (unsigned int cy = 0; cy < m_terrain->GetChunkCountY(); cy++)
+				for (unsigned int cx = 0; cx < m_terrain->GetChunkCountX(); cx++)
+					m_versions[cy * m_terrain->GetChunkCountX() + cx] = m_terrain->GetChunkLightVersion(cx, cy);
+			m_version = m_terrain->GetLightVersion();
+		}
+
+		//Copies a rectangle of the light map, in tiles of the terrain, straight from its rows to the texture. Snapshots have no lights and are white.
+		void Upload(unsigned int x, unsigned int y, unsigned int w, unsigned int h)
+		{
+			Bindings::BindTexture(m_texture);
+			if (!m_terrain->GetLightMap())
+			{
+				m_white.assign(w * h, Color(255, 255, 255));
+				glTexSubImage2D(GL_TEXTURE_2D, 0, x - m_x, y - m_y, w, h, GL_RGBA, GL_UNSIGNED_BYTE, m_white.data());
+				return;
+			}
+			glPixelStorei(GL_UNPACK_ROW_LENGTH, m_terrain->GetWidth());
+			glTexSubImage2D(GL_TEXTURE_2D, 0, x - m_x, y - m_y, w, h, GL_RGBA, GL_UNSIGNED_BYTE, m_terrain->GetLightMap()->GetColors() + (size_t)y * m_terrain->GetWidth() + x);
+			glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+		}
+	};
+
+	//DO NOT USE. This is integrated in the terrain class. Keeps a vertex buffer per chunk of every layer so the visible terrain is drawn with one call per chunk.
+	class TerrainMesh
+	{
+		struct Chunk
+		{
+			unsigned int vao = 0, vbo = 0, count = 0, version = 0, anim = 0, used = 0;
+			bool built = false, animated = false;
+		};
+
+	public:
+		//DO NOT USE. This is integrated in the terrain class.
+		TerrainMesh(Terrain* ter)
+		{
+			m_terrain = ter;
+			m_chunks = std::vector<Chunk>(ter->GetLayerCount() * ter->GetChunkCountX() * ter->GetChunkCountY());
+			//Every chunk draws its quads with the same indices
+			if (!s_ibo)
+				s_ibo = SpriteBatch::CreateQuadIndices(Terrain::ChunkSize * Terrain::ChunkSize);
+		}
+
+		~TerrainMesh()
+		{
+			for (unsigned int i = 0; i < m_chunks.size(); i++)
+				Release(m_chunks[i]);
+		}
+
+		//DO NOT USE. Draws the chunks a camera can see. Chunks whose tiles or animations changed are rebuilt first. The lights come from the light texture.
+		void Render(Camera* cam, TileAtlas* atlas)
+		{
+			if (atlas != m_atlas)
+			{
+				m_atlas = atlas;
+				for (unsigned int i = 0; i < m_chunks.size(); i++)
+					m_chunks[i].built = false;
+			}
+			m_frame++;
+
+			int size = atlas->GetTilesize();
+			int cs = Terrain::ChunkSize;
+			int start_x = std::floor(cam->GetX() / (double)size) - 1;
+			int start_y = std::floor(cam->GetY() / (double)size) - 1;
+			int end_x = start_x + cam->GetWidth() + 2;
+			int end_y = start_y + cam->GetHeight() + 2;
+
+			int cx1 = std::max(start_x, 0) / cs, cy1 = std::max(start_y, 0) / cs;
+			int cx2 = std::min((end_x - 1) / cs, (int)m_terrain->GetChunkCountX() - 1);
+			int cy2 = std::min((end_y - 1) / cs, (int)m_terrain->GetChunkCountY() - 1);
+			if (end_x <= 0 || end_y <= 0)
+				return;
+
+			Bindings::BindTexture(atlas->GetTextureID());
+			Shaders::ts->SetShaderType(ShaderType::Textured);
+			Shaders::ts->SetScale(vecf(1, 1));
+			Shaders::ts->SetColor(Color(255, 255, 255));
+
+			for (unsigned int l = 0; l < m_terrain->GetLayerCount(); l++)
+			{
+				for (int cy = cy1; cy <= cy2; cy++)
+				{
+					for (int cx = cx1; cx <= cx2; cx++)
+					{
+						Chunk& chunk = GetChunk(l, cx, cy);
+						if (!IsCurrent(chunk, l, cx, cy))
+							Build(chunk, l, cx, cy);
+						chunk.used = m_frame;
+						if (chunk.count)
+						{
+							Bindings::BindVAO(chunk.vao);
+							Shaders::ts->SetPosition(vec2(cx * cs * size - cam->GetX(), cy * cs * size - cam->GetY()));
+							glDrawElements(GL_TRIANGLES, chunk.count, GL_UNSIGNED_SHORT, NULL);
+						}
+					}
+				}
+			}
+			Shaders::ts->ResetVertexColor();
+			Evict();
+		}
+
+		//DO NOT USE. Deletes the shared index buffer.
+		static void Clean()
+		{
+			if (s_ibo)
+				glDeleteBuffers(1, &s_ibo);
+			s_ibo = 0;
+		}
+
+	private:
+		Terrain* m_terrain;
+		TileAtlas* m_atlas = NULL;
+		std::vector<Chunk> m_chunks;
+		std::vector<ColorVertex> m_vertices;
+		std::vector<unsigned int> m_ids;
+		unsigned int m_frame = 0, m_evict = 0;
+		static unsigned int s_ibo;
+
+		inline Chunk& GetChunk(unsigned int layer, unsigned int cx, unsigned int cy)
+		{
+			return m_chunks[(layer * m_terrain->GetChunkCountY() + cy) * m_terrain->GetChunkCountX() + cx];
+		}
+
+		//A tile is hidden by the layers over it, so a chunk also depends on the chunks of the layers above.
+		inline unsigned int GetVersion(unsigned int layer, unsigned int cx, unsigned int cy)
+		{
+			unsigned int version = 0;
+			for (unsigned int l = layer; l < m_terrain->GetLayerCount(); l++)
+				version += m_terrain->GetChunkVersion(l, cx, cy);
+			return version;
+		}
+
+		inline bool IsCurrent(Chunk& chunk, unsigned int layer, unsigned int cx, unsigned int cy)
+		{
+			return chunk.built && chunk.version == GetVersion(layer, cx, cy) && (!chunk.animated || chunk.anim == m_atlas->GetAnimationVersion());
+		}
+
+		void Build(Chunk& chunk, unsigned int layer, unsigned int cx, unsigned int cy)
+		{
+			chunk.built = true;
+			chunk.animated = false;
+			chunk.version = GetVersion(layer, cx, cy);
+			chunk.anim = m_atlas->GetAnimationVersion();
+
+			float size = m_atlas->GetTilesize();
+			float aw = m_atlas->GetPixelSize().width, ah = m_atlas->GetPixelSize().height;
+			unsigned int layers = m_terrain->GetLayerCount();
+			unsigned int x1 = cx * Terrain::ChunkSize, y1 = cy * Terrain::ChunkSize;
+			unsigned int x2 = std::min(x1 + Terrain::ChunkSize, m_terrain->GetWidth()), y2 = std::min(y1 + Terrain::ChunkSize, m_terrain->GetHeight());
+
+			//Copy the chunk of this layer and of the layers over it
+			unsigned int w = x2 - x1, h = y2 - y1;
+			m_ids.resize((layers - layer) * w * h);
+			for (unsigned int a = layer; a < layers; a++)
+				m_terrain->GetRegion(a, x1, y1, Size(w, h), &m_ids[(a - layer) * w * h]);
+
+			m_vertices.clear();
+			for (unsigned int y = y1; y < y2; y++)
+			{
+				for (unsigned int x = x1; x < x2; x++)
+				{
+					unsigned int offset = (y - y1) * w + x - x1;
+					unsigned int val = m_ids[offset];
+					if (val >= m_atlas->GetTileCount())
+						continue;
+
+					//Same culling as the tile by tile path: only draw the tile if it is the top one or if a tile over it is transparent
+					bool alphaup = layer == layers - 1;
+					for (unsigned int a = layer; a < layers && !alphaup; a++)
+					{
+						unsigned int up = m_ids[(a - layer) * w * h + offset];
+						if (up < m_atlas->GetTileCount() && m_atlas->GetTile(up)->HasAlpha())
+							alphaup = true;
+					}
+					if (!alphaup)
+						continue;
+
+					Tile* tile = m_atlas->GetTile(val);
+					if (tile->IsAnimated())
+						chunk.animated = true;
+					vec2 cell = tile->GetAtlasLocation(tile->GetAnimationState());
+					float u1 = cell.x * size / aw, v1 = cell.y * size / ah, u2 = (cell.x + 1) * size / aw, v2 = (cell.y + 1) * size / ah;
+					float px = (x - x1) * size, py = (y - y1) * size;
+					Color c(255, 255, 255);
+
+					m_vertices.push_back({ px, py, u1, v1, c });
+					m_vertices.push_back({ px + size, py, u2, v1, c });
+					m_vertices.push_back({ px + size, py + size, u2, v2, c });
+					m_vertices.push_back({ px, py + size, u1, v2, c });
+				}
+			}
+
+			if (m_vertices.empty())
+			{
+				Release(chunk);
+				return;
+			}
+			chunk.count = m_vertices.size() / 4 * 6;
+
+			if (!chunk.vao)
+			{
+				glGenVertexArrays(1, &chunk.vao);
+				Bindings::BindVAO(chunk.vao);
+				glGenBuffers(1, &chunk.vbo);
+				glBindBuffer(GL_ARRAY_BUFFER, chunk.vbo);
+				glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(ColorVertex), (void*)0);
+				glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(ColorVertex), (void*)(sizeof(float) * 2));
+				glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(ColorVertex), (void*)(sizeof(float) * 4));
+				glEnableVertexAttribArray(2);
+				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, s_ibo);
+			}
+			else
+				glBindBuffer(GL_ARRAY_BUFFER, chunk.vbo);
+			glBufferData(GL_ARRAY_BUFFER, m_vertices.size() * sizeof(ColorVertex), m_vertices.data(), chunk.animated ? GL_DYNAMIC_DRAW : GL_STATIC_DRAW);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+		}
+
+		inline void Release(Chunk& chunk)
+		{
+			if (chunk.vao)
+			{
+				glDeleteVertexArrays(1, &chunk.vao);
+				glDeleteBuffers(1, &chunk.vbo);
+				if (Bindings::s_vao == chunk.vao)
+					Bindings::s_vao = 0;
+			}
+			chunk.vao = 0;
+			chunk.vbo = 0;
+			chunk.count = 0;
+		}
+
+		//Frees a few of the chunks that haven't been seen for a while so exploring a big terrain doesn't keep every mesh alive.
+		void Evict()
+		{
+			for (unsigned int i = 0; i < 64 && m_chunks.size(); i++)
+			{
+				m_evict = (m_evict + 1) % m_chunks.size();
+				if (m_chunks[m_evict].vao && m_frame - m_chunks[m_evict].used > 600)
+				{
+					Release(m_chunks[m_evict]);
+					m_chunks[m_evict].built = false;
+				}
+			}
+		}
+	};
+	unsigned int TerrainMesh::s_ibo;
+
+	//DO NOT USE. This is integrated in the terrain class. Keeps every layer in an integer texture of tile ids so a layer is drawn with a single quad whatever the zoom.
+	class TerrainTileMap
+	{
+	public:
+		//DO NOT USE. This is integrated in the terrain class.
+		TerrainTileMap(Terrain* ter)
+		{
+			m_terrain = ter;
+			unsigned int chunks = ter->GetChunkCountX() * ter->GetChunkCountY();
+
+			int max;
+			glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max);
+			if (ter->GetWidth() > (unsigned int)max || ter->GetHeight() > (unsigned int)max)
+			{
+				ThrowException(L"Terrain is bigger than the maximum texture size. It will be rendered in chunks", ExceptionGravity::Warning);
+				m_supported = false;
+				return;
+			}
+			m_supported = true;
+
+			std::vector<unsigned int> ids(ter->GetWidth() * ter->GetHeight());
+			m_textures = std::vector<unsigned int>(ter->GetLayerCount());
+			for (unsigned int l = 0; l < ter->GetLayerCount(); l++)
+			{
+				ter->GetRegion(l, 0, 0, Size(ter->GetWidth(), ter->GetHeight()), ids.data());
+
+				glGenTextures(1, &m_textures[l]);
+				CreateTexture(m_textures[l]);
+				glTexImage2D(GL_TEXTURE_2D, 0, GL_R32UI, ter->GetWidth(), ter->GetHeight(), 0, GL_RED_INTEGER, GL_UNSIGNED_INT, ids.data());
+				for (unsigned int c = 0; c < chunks; c++)
+					m_versions.push_back(ter->GetChunkVersion(l, c % ter->GetChunkCountX(), c / ter->GetChunkCountX()));
+			}
+
+			glGenTextures(1, &m_lut);
+			CreateTexture(m_lut);
+
+			if (!s_vao)
+			{
+				HALF_VERT vecs[12] =
+				{
+					0, 0,
+					1, 1,
+					1, 0,
+					0, 0,
+					1, 1,
+					0, 1
+				};
+				glGenVertexArrays(1, &s_vao);
+				Bindings::BindVAO(s_vao);
+				glGenBuffers(1, &s_vbo);
+				glBindBuffer(GL_ARRAY_BUFFER, s_vbo);
+				glBufferData(GL_ARRAY_BUFFER, sizeof(vecs), vecs, GL_STATIC_DRAW);
+				glVertexAttribPointer(0, 2, VERTEX_TYPE, GL_FALSE, sizeof(float) * 2, NULL);
+				glVertexAttribPointer(1, 2, VERTEX_TYPE, GL_FALSE, sizeof(float) * 2, NULL);
+				glBindBuffer(GL_ARRAY_BUFFER, 0);
+			}
+		}
+
+		~TerrainTileMap()
+		{
+			if (m_textures.size())
+				glDeleteTextures(m_textures.size(), m_textures.data());
+			if (m_lut)
+				glDeleteTextures(1, &m_lut);
+			Bindings::s_tex = 0;
+		}
+
+		//DO NOT USE. Draws the layers a camera can see. Returns false if the terrain can't be drawn this way.
+		bool Render(Camera* cam, TileAtlas* atlas)
+		{
+			if (!m_supported)
+				return false;
+			Update(atlas);
+
+			int size = atlas->GetTilesize();
+			int start_x = std::max((int)std::floor(cam->GetX() / (double)size) - 1, 0);
+			int start_y = std::max((int)std::floor(cam->GetY() / (double)size) - 1, 0);
+			int end_x = std::min(start_x + (int)cam->GetWidth() + 2, (int)m_terrain->GetWidth());
+			int end_y = std::min(start_y + (int)cam->GetHeight() + 2, (int)m_terrain->GetHeight());
+			if (end_x <= start_x || end_y <= start_y)
+				return true;
+
+			Shaders::tm->Use();
+			Shaders::tm->SetMap(size, atlas->GetPixelSize(), Size(m_terrain->GetWidth(), m_terrain->GetHeight()), atlas->GetTileCount());
+			Shaders::tm->SetArea(vec2(start_x * size - cam->GetX(), start_y * size - cam->GetY()), Size((end_x - start_x) * size, (end_y - start_y) * size), vec2(cam->GetX(), cam->GetY()));
+
+			//The terrain fits in a texture so its light texture holds all of it. It uploads through the texture unit 0, so before the other units are made active.
+			unsigned int light = m_terrain->GetLightTexture()->Update(cam, size);
+			glActiveTexture(GL_TEXTURE3);
+			glBindTexture(GL_TEXTURE_2D, light);
+			glActiveTexture(GL_TEXTURE2);
+			glBindTexture(GL_TEXTURE_2D, m_lut);
+			Bindings::BindVAO(s_vao);
+			for (unsigned int l = 0; l < m_textures.size(); l++)
+			{
+				glActiveTexture(GL_TEXTURE1);
+				glBindTexture(GL_TEXTURE_2D, m_textures[l]);
+				glActiveTexture(GL_TEXTURE0);
+				Bindings::BindTexture(atlas->GetTextureID());
+				glDrawArrays(GL_TRIANGLES, 0, 6);
+			}
+			Shaders::ts->Use();
+			return true;
+		}
+
+		//DO NOT USE. Deletes the shared quad.
+		static void Clean()
+		{
+			if (s_vao)
+			{
+				glDeleteVertexArrays(1, &s_vao);
+				glDeleteBuffers(1, &s_vbo);
+			}
+			s_vao = 0;
+			s_vbo = 0;
+		}
+
+	private:
+		Terrain* m_terrain;
+		TileAtlas* m_atlas = NULL;
+		std::vector<unsigned int> m_textures, m_versions, m_buffer;
+		unsigned int m_lut = 0, m_anim = 0;
+		bool m_supported;
+		static unsigned int s_vao, s_vbo;
+
+		inline void CreateTexture(unsigned int tex)
+		{
+			Bindings::BindTexture(tex);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		}
+
+		//Patches the chunks of the id textures that changed since the last frame and rebuilds the atlas lookup when tiles animate.
+		void Update(TileAtlas* atlas)
+		{
+			unsigned int chx = m_terrain->GetChunkCountX(), chunks = chx * m_terrain->GetChunkCountY();
+			for (unsigned int l = 0; l < m_textures.size(); l++)
+			{
+				for (unsigned int c = 0; c < chunks; c++)
+				{
+					unsigned int version = m_terrain->GetChunkVersion(l, c % chx, c / chx);
+					if (m_versions[l * chunks + c] == version)
+						continue;
+					m_versions[l * chunks + c] = version;
+
+					unsigned int x1 = c % chx * Terrain::ChunkSize, y1 = c / chx * Terrain::ChunkSize;
+					unsigned int w = std::min(Terrain::ChunkSize, m_terrain->GetWidth() - x1), h = std::min(Terrain::ChunkSize, m_terrain->GetHeight() - y1);
+					m_buffer.resize(w * h);
+					m_terrain->GetRegion(l, x1, y1, Size(w, h), m_buffer.data());
+					Bindings::BindTexture(m_textures[l]);
+					glTexSubImage2D(GL_TEXTURE_2D, 0, x1, y1, w, h, GL_RED_INTEGER, GL_UNSIGNED_INT, m_buffer.data());
+				}
+			}
+
+			if (atlas != m_atlas || atlas->GetAnimationVersion() != m_anim)
+			{
+				m_atlas = atlas;
+				m_anim = atlas->GetAnimationVersion();
+				std::vector<unsigned short> lut;
+				for (unsigned int i = 0; i < atlas->GetTileCount(); i++)
+				{
+					Tile* tile = atlas->GetTile(i);
+					vec2 cell = tile->GetAtlasLocation(tile->GetAnimationState());
+					lut.push_back(cell.x);
+					lut.push_back(cell.y);
+				}
+				if (lut.size())
+				{
+					Bindings::BindTexture(m_lut);
+					glTexImage2D(GL_TEXTURE_2D, 0, GL_RG16UI, atlas->GetTileCount(), 1, 0, GL_RG_INTEGER, GL_UNSIGNED_SHORT, lut.data());
+				}
+			}
+		}
+	};
+	unsigned int TerrainTileMap::s_vao, TerrainTileMap::s_vbo;
+
+	inline TerrainTileMap* Terrain::GetTileMap()
+	{
+		if (!m_tilemap)
+			m_tilemap = new TerrainTileMap(this);
+		return m_tilemap;
+	}
+
+	inline TerrainLightTexture* Terrain::GetLightTexture()
+	{
+		if (!m_lighttexture)
+			m_lighttexture = new TerrainLightTexture(this);
+		return m_lighttexture;
+	}
+
+	inline TerrainMesh* Terrain::GetMesh()
+	{
+		if (!m_mesh)
+			m_mesh = new TerrainMesh(this);
+		return m_mesh;
+	}
+
+	//Calls like std::min() take the constants by reference and need them defined once
+	const unsigned int Terrain::ChunkSize, Terrain::ChunkShift, Terrain::ChunkMask, Terrain::FileMagic, Terrain::FileVersion, Terrain::CompressedVersion, Terrain::JournalMagic, Terrain::JournalVersion;
+
+	inline Terrain::~Terrain()
+	{
+		//The recorded frame may still draw this terrain. A snapshot is never drawn nor lit, and may be deleted on a thread without the OpenGL context.
+		if (m_light)
+		{
+			Bindings::FlushBatch();
+			Bindings::ForgetLighting(this);
+		}
+		if (m_mesh)
+			delete m_mesh;
+		if (m_tilemap)
+			delete m_tilemap;
+		if (m_lighttexture)
+			delete m_lighttexture;
+		delete m_light;
+	}
+
+	inline TerrainTask::~TerrainTask()
+	{
+		Wait();
+		if (m_terrain)
+			delete m_terrain;
+		if (m_snapshot)
+			delete m_snapshot;
+	}
+
+	inline Terrain* TerrainTask::TakeTerrain()
+	{
+		if (!m_done)
+			return NULL;
+		Wait();
+		if (m_failed)
+			return NULL;
+		Terrain* terrain = m_terrain;
+		m_terrain = NULL;
+		return terrain;
+	}
+
+	//Called on the loading thread to fill a chunk that was never saved. tiles has ChunkSize rows of ChunkSize ids for every layer, one layer after the other.
+	typedef void(*ChunkGenerator)(int cx, int cy, unsigned int* tiles, void* userdata);
+
+	//A terrain with no fixed size. Its chunks are loaded from a directory around the watched cameras on a background thread, and saved back when they are unloaded.
+	class TerrainWorld
+	{
+		struct WorldChunk
+		{
+			int cx, cy;
+			//Every layer, one after the other
+			std::vector<unsigned char> tiles;
+			bool dirty = false;
+			unsigned int used = 0;
+			std::list<unsigned long long>::iterator lru;
+		};
+
+		struct Job
+		{
+			bool save;
+			int cx, cy;
+			std::vector<unsigned char> tiles;
+			WorldChunk* chunk;
+		};
+
+	public:
+		//DO NOT USE. The first bytes of chunk files.
+		static const unsigned int ChunkMagic = 0x43545A47;
+		//DO NOT USE. The version of chunk files.
+		static const unsigned int ChunkVersion = 1;
+
+		inline TerrainWorld() {}
+
+		//The directory must exist. tilesize is the size of the tiles in pixels, viewdistance the number of chunks loaded past the edges of the cameras and maxchunks the number of chunks kept in memory.
+		TerrainWorld(std::wstring directory, std::vector<TileIdWidth> widths, unsigned int tilesize, unsigned int viewdistance = 1, unsigned int maxchunks = 256)
+		{
+			m_directory = directory;
+			m_widths = widths;
+			m_tilesize = std::max(1u, tilesize);
+			m_distance = viewdistance;
+			m_maxchunks = std::max(1u, maxchunks);
+			m_header = { ChunkMagic, ChunkVersion, Terrain::ChunkSize, (unsigned int)widths.size() };
+			for (unsigned int l = 0; l < widths.size(); l++)
+			{
+				m_offsets.push_back(m_chunkbytes);
+				m_chunkbytes += Terrain::ChunkSize * Terrain::ChunkSize * widths[l];
+				m_header.push_back(widths[l]);
+			}
+			m_thread = std::thread(&TerrainWorld::Work, this);
+		}
+
+		//Saves the modified chunks and waits for the loading thread.
+		~TerrainWorld()
+		{
+			{
+				//Loads that didn't start are not needed anymore
+				std::lock_guard<std::mutex> lock(m_mutex);
+				for (unsigned int i = 0; i < m_jobs.size();)
+				{
+					if (!m_jobs[i]->save)
+					{
+						delete m_jobs[i]->chunk;
+						delete m_jobs[i];
+						m_jobs.erase(m_jobs.begin() + i);
+					}
+					else
+						i++;
+				}
+			}
+			for (auto& resident : m_resident)
+			{
+				if (resident.second->dirty)
+					QueueSave(resident.second, false);
+				delete resident.second;
+			}
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_running = false;
+			}
+			m_condition.notify_all();
+			m_thread.join();
+			for (WorldChunk* chunk : m_loaded)
+				delete chunk;
+		}
+
+		//Sets the function used to create the chunks that are not in the directory. Set it before the first Update().
+		inline void SetGenerator(ChunkGenerator generator, void* userdata = NULL)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_generator = generator;
+			m_userdata = userdata;
+		}
+
+		//Keeps the chunks a camera can see loaded.
+		inline void AddCamera(Camera* cam)
+		{
+			m_cameras.push_back(cam);
+		}
+
+		//Stops following a camera.
+		inline void RemoveCamera(Camera* cam)
+		{
+			m_cameras.erase(std::remove(m_cameras.begin(), m_cameras.end(), cam), m_cameras.end());
+		}
+
+		//Call this every frame. Takes the chunks the loading thread is done with, asks for the ones the cameras need and unloads the least recently seen ones.
+		void Update()
+		{
+			m_frame++;
+			std::vector<WorldChunk*> loaded;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				loaded.swap(m_loaded);
+			}
+			for (WorldChunk* chunk : loaded)
+			{
+				unsigned long long key = Key(chunk->cx, chunk->cy);
+				m_pending.erase(key);
+				m_lru.push_front(key);
+				chunk->lru = m_lru.begin();
+				chunk->used = m_frame;
+				m_resident[key] = chunk;
+			}
+
+			for (Camera* cam : m_cameras)
+			{
+				int x1 = (int)std::floor(cam->GetX() / (double)m_tilesize) - 1, y1 = (int)std::floor(cam->GetY() / (double)m_tilesize) - 1;
+				int cx1 = (x1 >> Terrain::ChunkShift) - (int)m_distance, cy1 = (y1 >> Terrain::ChunkShift) - (int)m_distance;
+				int cx2 = ((x1 + (int)cam->GetWidth() + 2) >> Terrain::ChunkShift) + (int)m_distance;
+				int cy2 = ((y1 + (int)cam->GetHeight() + 2) >> Terrain::ChunkShift) + (int)m_distance;
+				for (int cy = cy1; cy <= cy2; cy++)
+				{
+					for (int cx = cx1; cx <= cx2; cx++)
+					{
+						unsigned long long key = Key(cx, cy);
+						auto resident = m_resident.find(key);
+						if (resident != m_resident.end())
+						{
+							resident->second->used = m_frame;
+							m_lru.splice(m_lru.begin(), m_lru, resident->second->lru);
+						}
+						else if (m_pending.insert(key).second)
+							QueueLoad(cx, cy);
+					}
+				}
+			}
+
+			//Chunks a camera needs this frame are never unloaded, even if there are too many
+			while (m_resident.size() > m_maxchunks)
+			{
+				WorldChunk* chunk = m_resident[m_lru.back()];
+				if (chunk->used == m_frame)
+					break;
+				Unload(chunk);
+			}
+		}
+
+		//Writes every modified chunk to the directory and waits until it is done.
+		void Save()
+		{
+			for (auto& resident : m_resident)
+			{
+				if (resident.second->dirty)
+					QueueSave(resident.second, false);
+			}
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_idle.wait(lock, [this]() { return m_jobs.empty() && !m_busy; });
+		}
+
+		//Gets the tile id of a place in the world. Places in chunks that are not loaded are 0xffffffff.
+		inline unsigned int GetTile(unsigned int layer, int x, int y)
+		{
+			WorldChunk* chunk = Find(x, y);
+			if (!chunk || layer >= m_widths.size())
+				return 0xffffffff;
+			return Terrain::ReadTile(chunk->tiles.data() + m_offsets[layer], m_widths[layer], ((y & Terrain::ChunkMask) << Terrain::ChunkShift) + (x & Terrain::ChunkMask));
+		}
+
+		//Sets the tile id of a place in the world. Returns false if its chunk is not loaded.
+		inline bool SetTile(unsigned int layer, int x, int y, unsigned int value)
+		{
+			WorldChunk* chunk = Find(x, y);
+			if (!chunk || layer >= m_widths.size())
+				return false;
+			Terrain::WriteTile(chunk->tiles.data() + m_offsets[layer], m_widths[layer], ((y & Terrain::ChunkMask) << Terrain::ChunkShift) + (x & Terrain::ChunkMask), value);
+			chunk->dirty = true;
+			return true;
+		}
+
+		//Checks if the chunk of a place is loaded.
+		inline bool IsLoaded(int x, int y)
+		{
+			return Find(x, y) != NULL;
+		}
+
+		//Returns the number of layers in the world.
+		inline unsigned int GetLayerCount()
+		{
+			return m_widths.size();
+		}
+
+		//Returns the number of bytes a layer uses for each tile id.
+		inline TileIdWidth GetLayerWidth(unsigned int layer)
+		{
+			return m_widths[layer];
+		}
+
+		//Returns the number of chunks in memory.
+		inline unsigned int GetResidentCount()
+		{
+			return m_resident.size();
+		}
+
+		//Returns the number of chunks waiting to be loaded.
+		inline unsigned int GetPendingCount()
+		{
+			return m_pending.size();
+		}
+
+		//Returns the number of chunk files that couldn't be read or written.
+		inline unsigned long long GetFailedCount()
+		{
+			return m_failed;
+		}
+
+		//DO NOT USE. Draws the loaded chunks a camera can see.
+		void Render(Camera* cam, TileAtlas* atlas)
+		{
+			unsigned int size = atlas->GetTilesize(), layers = m_widths.size();
+			int x1 = (int)std::floor(cam->GetX() / (double)size) - 1, y1 = (int)std::floor(cam->GetY() / (double)size) - 1;
+			int x2 = x1 + cam->GetWidth() + 2, y2 = y1 + cam->GetHeight() + 2;
+			std::vector<unsigned int> ids(layers);
+
+			for (int cy = y1 >> Terrain::ChunkShift; cy <= (y2 - 1) >> Terrain::ChunkShift; cy++)
+			{
+				for (int cx = x1 >> Terrain::ChunkShift; cx <= (x2 - 1) >> Terrain::ChunkShift; cx++)
+				{
+					auto resident = m_resident.find(Key(cx, cy));
+					if (resident == m_resident.end())
+						continue;
+					const unsigned char* tiles = resident->second->tiles.data();
+					int tx1 = std::max(x1, cx << Terrain::ChunkShift), tx2 = std::min(x2, (cx + 1) << Terrain::ChunkShift);
+					int ty1 = std::max(y1, cy << Terrain::ChunkShift), ty2 = std::min(y2, (cy + 1) << Terrain::ChunkShift);
+					for (int y = ty1; y < ty2; y++)
+					{
+						for (int x = tx1; x < tx2; x++)
+						{
+							unsigned int i = ((y & Terrain::ChunkMask) << Terrain::ChunkShift) + (x & Terrain::ChunkMask);
+							for (unsigned int l = 0; l < layers; l++)
+								ids[l] = Terrain::ReadTile(tiles + m_offsets[l], m_widths[l], i);
+
+							//Same culling as the terrain: only draw a tile if it is the top one or if a tile over it is transparent
+							for (unsigned int l = 0; l < layers; l++)
+							{
+								if (ids[l] >= atlas->GetTileCount())
+									continue;
+								bool alphaup = l == layers - 1;
+								for (unsigned int a = l; a < layers && !alphaup; a++)
+									alphaup = ids[a] < atlas->GetTileCount() && atlas->GetTile(ids[a])->HasAlpha();
+								if (alphaup)
+									atlas->GetTile(ids[l])->Render(atlas->GetTextureID(), x * (int)size - cam->GetX(), y * (int)size - cam->GetY(), Color(255, 255, 255));
+							}
+						}
+					}
+				}
+			}
+		}
+
+	private:
+		std::wstring m_directory;
+		std::vector<TileIdWidth> m_widths;
+		std::vector<unsigned int> m_offsets;
+		//What every chunk file starts with: the magic, the version, the chunk size, the layer count and the width of every layer
+		std::vector<unsigned int> m_header;
+		unsigned int m_chunkbytes = 0, m_tilesize, m_distance, m_maxchunks, m_frame = 0;
+		ChunkGenerator m_generator = NULL;
+		void* m_userdata = NULL;
+		std::vector<Camera*> m_cameras;
+
+		std::unordered_map<unsigned long long, WorldChunk*> m_resident;
+		std::unordered_set<unsigned long long> m_pending;
+		//Most recently seen chunk first
+		std::list<unsigned long long> m_lru;
+		WorldChunk* m_last = NULL;
+
+		std::thread m_thread;
+		std::vector<Job*> m_jobs;
+		std::vector<WorldChunk*> m_loaded;
+		std::mutex m_mutex;
+		std::condition_variable m_condition, m_idle;
+		std::atomic<unsigned long long> m_failed{ 0 };
+		bool m_running = true, m_busy = false;
+
+		static inline unsigned long long Key(int cx, int cy)
+		{
+			return ((unsigned long long)(unsigned int)cx << 32) | (unsigned int)cy;
+		}
+
+		//The loaded chunk of a tile
+		inline WorldChunk* Find(int x, int y)
+		{
+			int cx = x >> Terrain::ChunkShift, cy = y >> Terrain::ChunkShift;
+			if (m_last && m_last->cx == cx && m_last->cy == cy)
+				return m_last;
+			auto resident = m_resident.find(Key(cx, cy));
+			if (resident == m_resident.end())
+				return NULL;
+			m_last = resident->second;
+			return m_last;
+		}
+
+		inline std::wstring GetPath(int cx, int cy)
+		{
+			return m_directory + L"/chunk_" + std::to_wstring(cx) + L"_" + std::to_wstring(cy) + L".bin";
+		}
+
+		void Unload(WorldChunk* chunk)
+		{
+			unsigned long long key = Key(chunk->cx, chunk->cy);
+			m_resident.erase(key);
+			m_lru.erase(chunk->lru);
+			if (m_last == chunk)
+				m_last = NULL;
+			if (chunk->dirty)
+				QueueSave(chunk, true);
+			delete chunk;
+		}
+
+		//The tiles are moved to the job when the chunk is unloaded and copied otherwise.
+		void QueueSave(WorldChunk* chunk, bool move)
+		{
+			Job* job = new Job();
+			job->save = true;
+			job->cx = chunk->cx;
+			job->cy = chunk->cy;
+			job->chunk = NULL;
+			if (move)
+				job->tiles.swap(chunk->tiles);
+			else
+				job->tiles = chunk->tiles;
+			chunk->dirty = false;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_jobs.push_back(job);
+			}
+			m_condition.notify_one();
+		}
+
+		void QueueLoad(int cx, int cy)
+		{
+			Job* job = new Job();
+			job->save = false;
+			job->cx = cx;
+			job->cy = cy;
+			job->chunk = new WorldChunk();
+			job->chunk->cx = cx;
+			job->chunk->cy = cy;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_jobs.push_back(job);
+			}
+			m_condition.notify_one();
+		}
+
+		//Jobs run in the order they were queued, so a chunk that is unloaded and needed again is read after it was written.
+		void Work()
+		{
+			while (true)
+			{
+				Job* job;
+				ChunkGenerator generator;
+				void* userdata;
+				{
+					std::unique_lock<std::mutex> lock(m_mutex);
+					m_condition.wait(lock, [this]() { return !m_jobs.empty() || !m_running; });
+					if (m_jobs.empty())
+						return;
+					job = m_jobs.front();
+					m_jobs.erase(m_jobs.begin());
+					m_busy = true;
+					generator = m_generator;
+					userdata = m_userdata;
+				}
+
+				if (job->save)
+				{
+					if (!Write(job))
+						m_failed++;
+				}
+				else
+				{
+					Read(job->chunk, generator, userdata);
+					std::lock_guard<std::mutex> lock(m_mutex);
+					m_loaded.push_back(job->chunk);
+				}
+				delete job;
+
+				{
+					std::lock_guard<std::mutex> lock(m_mutex);
+					m_busy = false;
+				}
+				m_idle.notify_all();
+			}
+		}
+
+		bool Write(Job* job)
+		{
+			FILE* file = _wfopen(GetPath(job->cx, job->cy).c_str(), L"wb");
+			if (!file)
+				return false;
+			bool ok = fwrite(m_header.data(), sizeof(unsigned int), m_header.size(), file) == m_header.size()
+				&& fwrite(job->tiles.data(), 1, job->tiles.size(), file) == job->tiles.size();
+			fclose(file);
+			return ok;
+		}
+
+		//A file written with other layers or another chunk size counts as failed and the chunk is generated again.
+		void Read(WorldChunk* chunk, ChunkGenerator generator, void* userdata)
+		{
+			chunk->tiles.resize(m_chunkbytes);
+			FILE* file = _wfopen(GetPath(chunk->cx, chunk->cy).c_str(), L"rb");
+			if (file)
+			{
+				std::vector<unsigned int> header(m_header.size());
+				bool ok = fread(header.data(), sizeof(unsigned int), header.size(), file) == header.size() && header == m_header
+					&& fread(chunk->tiles.data(), 1, m_chunkbytes, file) == m_chunkbytes;
+				fclose(file);
+				if (ok)
+					return;
+				m_failed++;
+			}
+
+			//Chunks that were never saved are generated, or filled with tile 0 like a new terrain
+			const unsigned int count = Terrain::ChunkSize * Terrain::ChunkSize;
+			std::vector<unsigned int> tiles(count * m_widths.size(), 0);
+			if (generator)
+				generator(chunk->cx, chunk->cy, tiles.data(), userdata);
+			for (unsigned int l = 0; l < m_widths.size(); l++)
+			{
+				unsigned char* dst = chunk->tiles.data() + m_offsets[l];
+				switch (m_widths[l])
+				{
+				case TileIdWidth::TileId8:
+					Terrain::Narrow(tiles.data() + l * count, dst, count);
+					break;
+				case TileIdWidth::TileId16:
+					Terrain::Narrow(tiles.data() + l * count, (unsigned short*)dst, count);
+					break;
+				default:
+					memcpy(dst, tiles.data() + l * count, count * sizeof(unsigned int));
+				}
+			}
+		}
+	};
+	
+	//Used to check collisions.
+	class TilemapEntity
+	{
+	public:
+		inline TilemapEntity() {}
+		inline TilemapEntity(unsigned int width, unsigned int height)
+		{
+			m_width = width;
+			m_height = height;
+		}
+
+		//Sets the entity size
+		inline void SetSize(unsigned int width, unsigned int height)
+		{
+			m_width += width;
+			m_height += height;
+		}
+
+		//Adds x and y to the entity position checking for collision. layer is the layer where to find walls.
+		bool Move(vec2 pos, int tilesize, int layer, Terrain* ter, TileAtlas* atlas)
+		{
+			if ((m_x + m_width) % tilesize == 0)
+			{
+				if (pos.x > 0)
+				{
+					unsigned int t1 = ter->GetTile(layer, (m_x + m_width) / tilesize, std::floor(m_y / (double)tilesize));
+					unsigned int t2 = ter->GetTile(layer, (m_x + m_width) / tilesize, std::ceil(m_y / (double)tilesize));
+					bool tile1 = false, tile2 = false;
+					if (t1 != 0xffffffff)
+						tile1 = atlas->GetTile(t1)->HasCollision();
+					if (t2 != 0xffffffff)
+						tile2 = atlas->GetTile(t2)->HasCollision();
+
+					if (!(tile1 || tile2))
+					{
+						m_x += pos.x;
+						return true;
+					}
+					else
+						return false;
+				}
+				else if (pos.x < 0)
+				{
+					unsigned int t1 = ter->GetTile(layer, (m_x + m_width) / tilesize - 2, std::floor(m_y / (double)tilesize));
+					unsigned int t2 = ter->GetTile(layer, (m_x + m_width) / tilesize - 2, std::ceil(m_y / (double)tilesize));
+					bool tile1 = false, tile2 = false;
+					if (t1 != 0xffffffff)
+						tile1 = atlas->GetTile(t1)->HasCollision();
+					if (t2 != 0xffffffff)
+						tile2 = atlas->GetTile(t2)->HasCollision();
+
+					if (!(tile1 || tile2))
+					{
+						m_x += pos.x;
+						return true;
+					}
+					else
+						return false;
+				}
+			}
+
+			if ((m_y + m_height) % tilesize == 0)
+			{
+				if (pos.y > 0)
+				{
+					unsigned int t1 = ter->GetTile(layer, std::floor(m_x / (double)tilesize), (m_y + m_height) / tilesize);
+					unsigned int t2 = ter->GetTile(layer, std::ceil(m_x / (double)tilesize), (m_y + m_height) / tilesize);
+					bool tile1 = false, tile2 = false;
+					if (t1 != 0xffffffff)
+						tile1 = atlas->GetTile(t1)->HasCollision();
+					if (t2 != 0xffffffff)
+						tile2 = atlas->GetTile(t2)->HasCollision();
+
+					if (!(tile1 || tile2))
+					{
+						m_y += pos.y;
+						return true;
+					}
+					else
+						return false;
+				}
+				else if (pos.y < 0)
+				{
+					unsigned int t1 = ter->GetTile(layer, std::floor(m_x / (double)tilesize), (m_y + m_height) / tilesize - 2);
+					unsigned int t2 = ter->GetTile(layer, std::ceil(m_x / (double)tilesize), (m_y + m_height) / tilesize - 2);
+					bool tile1 = false, tile2 = false;
+					if (t1 != 0xffffffff)
+						tile1 = atlas->GetTile(t1)->HasCollision();
+					if (t2 != 0xffffffff)
+						tile2 = atlas->GetTile(t2)->HasCollision();
+
+					if (!(tile1 || tile2))
+					{
+						m_y += pos.y;
+						return true;
+					}
+					else
+						return false;
+				}
+			}
+
+			m_x += pos.x;
+			m_y += pos.y;
+			return true;
+		}
+
+		//Sets the entity position without checking for collision
+		inline void SetPosition(int x, int y)
+		{
+			m_x = x;
+			m_y = y;
+		}
+
+		//Returns the entity X position
+		inline int GetX()
+		{
+			return m_x;
+		}
+
+		//Returns the entity Y position
+		inline int GetY()
+		{
+			return m_y;
+		}
+
+		~TilemapEntity() {}
+
+	private:
+		int m_x = 0, m_y = 0;
+		unsigned int m_width, m_height;
+	};
+	
+	class Renderer;
+
+	//An UI element.
+	class UIElement
+	{
+	public:
+
+		//Checks if the mouse in clicking the element.
+		virtual bool IsClicked() = 0;
+		//DO NOT USE.
+		virtual void Render(Renderer*) = 0;
+		//Call this every frame.
+		virtual void Update() = 0;
+
+		//Sets the component poition.
+		inline void SetPosition(vec2 pos)
+		{
+			this->pos = pos;
+		}
+		
+		//Gets the poition of the element.
 		inline vec2 GetPos()
 		{
-			return pos;
+			return pos;
+		}
+
+	private:
+		vec2 pos;
+	};
+	
+	//DO NOT USE. This is automatically used by the renderer when deferred rendering is enabled. Records the draws of a frame and submits them sorted by framebuffer, layer, shader, texture and VAO.
+	class RenderQueue
+	{
+	public:
+		RenderQueue() {}
+		~RenderQueue() {}
+
+		//DO NOT USE. Sets the renderer and the layer the next quads are recorded for.
+		inline void SetTarget(Renderer* target, int layer)
+		{
+			m_target = target;
+			m_layer = layer;
+		}
+
+		//DO NOT USE.
+		inline void AddQuad(unsigned int tex, float x, float y, float w, float h, float u1, float v1, float u2, float v2, Color color)
+		{
+			Command& c = Add(m_target, m_layer, tex ? TexturedQuad : ColorQuad, tex, 0);
+			c.x = x; c.y = y; c.w = w; c.h = h;
+			c.u1 = u1; c.v1 = v1; c.u2 = u2; c.v2 = v2;
+			c.color = color;
+		}
+
+		//DO NOT USE.
+		inline void AddFill(Renderer* target, int layer, Color color)
+		{
+			Add(target, layer, FillCommand, 0, 0).color = color;
+		}
+
+		//DO NOT USE. The camera position and size are copied so it can be moved or deleted before the frame is submitted.
+		inline void AddTerrain(Renderer* target, int layer, Terrain* ter, Camera* cam, TileAtlas* atlas)
+		{
+			Add(target, layer, TerrainCommand, atlas->GetTextureID(), 0).index = m_terrains.size();
+			m_terrains.push_back({ ter, cam->GetX(), cam->GetY(), Size(cam->GetWidth(), cam->GetHeight()), atlas });
+		}
+
+		//DO NOT USE.
+		inline void AddMesh(Renderer* target, int layer, GeometryMesh* mesh, Color color, GeometryRenderingMode mode, vec2 pos, vecf scale)
+		{
+			Command& c = Add(target, layer, MeshCommand, 0, mesh->GetVAO());
+			c.color = color;
+			c.index = m_meshes.size();
+			m_meshes.push_back({ mesh, mode, pos, scale });
+		}
+
+		//DO NOT USE. Draws every recorded command and empties the queue.
+		void Submit();
+
+	private:
+		//The order of the commands of a layer.
+		enum CommandType : char { FillCommand, TerrainCommand, MeshCommand, ColorQuad, TexturedQuad };
+
+		struct Command
+		{
+			Renderer* target;
+			CommandType type;
+			unsigned int tex, index;
+			float x, y, w, h, u1, v1, u2, v2;
+			Color color;
+		};
+
+		//The camera position and size are copied, the terrain and the atlas flush the queue when they are deleted
+		struct TerrainDraw
+		{
+			Terrain* ter;
+			int x, y;
+			Size size;
+			TileAtlas* atlas;
+		};
+
+		struct MeshDraw
+		{
+			GeometryMesh* mesh;
+			GeometryRenderingMode mode;
+			vec2 pos;
+			vecf scale;
+		};
+
+		std::vector<Command> m_commands;
+		std::vector<TerrainDraw> m_terrains;
+		std::vector<MeshDraw> m_meshes;
+		std::vector<Renderer*> m_targets;
+		std::vector<std::pair<unsigned long long, unsigned int>> m_keys, m_sorted;
+		Renderer* m_target = NULL;
+		int m_layer = 0;
+		bool m_submitting = false;
+		//The terrains are drawn through this one, a camera made for each of them would flush the queue and reset the lighting when deleted
+		Camera m_camera;
+
+		Command& Add(Renderer* target, int layer, CommandType type, unsigned int tex, unsigned int vao);
+
+		//Sorts the keys with a least significant digit radix sort. It is stable so the commands with the same key keep their order.
+		void Sort()
+		{
+			m_sorted.resize(m_keys.size());
+			for (unsigned int shift = 0; shift < 64; shift += 8)
+			{
+				unsigned int counts[257] = { 0 };
+				for (auto& key : m_keys)
+					counts[((key.first >> shift) & 0xff) + 1]++;
+				//Every key has the same byte
+				if (counts[((m_keys[0].first >> shift) & 0xff) + 1] == m_keys.size())
+					continue;
+				for (int i = 1; i < 257; i++)
+					counts[i] += counts[i - 1];
+				for (auto& key : m_keys)
+					m_sorted[counts[(key.first >> shift) & 0xff]++] = key;
+				m_keys.swap(m_sorted);
+			}
+		}
+	};
+
+	//DO NOT USE.
+	namespace Queueing
+	{
+		RenderQueue* rq;
+	}
+
+	//Called when an asynchronous readback is done. The pixels are RGBA with the bottom row first, like Renderer::GetContent(). They are only valid during the call, copy them to keep them.
+	typedef void(*ReadbackCallback)(unsigned char* pixels, Size size, void* userdata);
+
+	//DO NOT USE. This is automatically used by the renderer. Reads framebuffers into a ring of pixel buffers so the GPU copies them while the game goes on, and gives the pixels a few frames later.
+	class ReadbackRing
+	{
+		struct Slot
+		{
+			unsigned int pbo = 0, capacity = 0, frame;
+			Size size;
+			ReadbackCallback callback = NULL;
+			void* userdata;
+		};
+
+	public:
+		//The number of readbacks that can be in flight.
+		static const unsigned int RingSize = 3;
+		//The number of frames a readback waits before its pixels are mapped.
+		static const unsigned int Latency = 2;
+
+		ReadbackRing() {}
+
+		~ReadbackRing()
+		{
+			for (auto& slot : m_slots)
+				if (slot.pbo)
+					glDeleteBuffers(1, &slot.pbo);
+			for (auto& spare : m_spares)
+				glDeleteBuffers(1, &spare.first);
+			for (auto& kept : m_kept)
+				glDeleteBuffers(1, &kept.first);
+		}
+
+		//DO NOT USE. Starts reading the bound framebuffer.
+		void Request(Size size, ReadbackCallback callback, void* userdata)
+		{
+			//Every slot is in flight, the oldest one has to be finished now
+			if (m_count == RingSize)
+			{
+				if (m_completing)
+				{
+					ThrowException(L"Too many readbacks started from a readback callback", ExceptionGravity::Warning);
+					return;
+				}
+				Complete();
+			}
+
+			Slot& slot = m_slots[(m_first + m_count) % RingSize];
+			if (!slot.pbo && m_spares.size())
+			{
+				slot.pbo = m_spares.back().first;
+				slot.capacity = m_spares.back().second;
+				m_spares.pop_back();
+			}
+			if (!slot.pbo)
+				glGenBuffers(1, &slot.pbo);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+			if (slot.capacity < size.width * size.height * 4)
+			{
+				slot.capacity = size.width * size.height * 4;
+				glBufferData(GL_PIXEL_PACK_BUFFER, slot.capacity, NULL, GL_STREAM_READ);
+			}
+			glReadPixels(0, 0, size.width, size.height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+			slot.size = size;
+			slot.callback = callback;
+			slot.userdata = userdata;
+			slot.frame = m_frame;
+			m_count++;
+		}
+
+		//DO NOT USE. Called once per frame. Gives the pixels of the readbacks that are old enough.
+		void Update()
+		{
+			m_frame++;
+			while (m_count && m_frame - m_slots[m_first].frame >= Latency)
+				Complete();
+		}
+
+		//DO NOT USE. Gives the pixels of every readback, waiting for the GPU if needed.
+		void Finish()
+		{
+			while (m_count)
+				Complete();
+		}
+
+		//DO NOT USE. Gives the pixels of the readbacks started with userdata, waiting for the GPU if needed. The other readbacks keep waiting for their frame.
+		void Finish(void* userdata)
+		{
+			for (unsigned int i = 0; i < m_count; i++)
+			{
+				Slot& slot = m_slots[(m_first + i) % RingSize];
+				if (slot.callback && slot.userdata == userdata)
+					Deliver(slot);
+			}
+		}
+
+		//DO NOT USE. Called from a readback callback. Keeps the pixels mapped after the callback, so another thread can read them, and returns their buffer. Give it back with Release().
+		inline unsigned int Keep()
+		{
+			m_keep = true;
+			return m_delivering;
+		}
+
+		//DO NOT USE. Unmaps a buffer taken with Keep() so a later readback can use it.
+		void Release(unsigned int pbo)
+		{
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			m_spares.push_back(std::make_pair(pbo, m_kept[pbo]));
+			m_kept.erase(pbo);
+		}
+
+	private:
+		Slot m_slots[RingSize];
+		unsigned int m_first = 0, m_count = 0, m_frame = 0, m_delivering = 0;
+		bool m_completing = false, m_keep = false;
+		//The capacity of the buffers taken with Keep(), and the buffers given back by Release() with theirs
+		std::unordered_map<unsigned int, unsigned int> m_kept;
+		std::vector<std::pair<unsigned int, unsigned int>> m_spares;
+
+		//Maps the pixels of a readback and calls its callback. A slot whose buffer was kept gets a new one.
+		void Deliver(Slot& slot)
+		{
+			m_completing = true;
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+			unsigned char* pixels = (unsigned char*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, slot.size.width * slot.size.height * 4, GL_MAP_READ_BIT);
+			if (pixels)
+			{
+				m_delivering = slot.pbo;
+				slot.callback(pixels, slot.size, slot.userdata);
+				if (m_keep)
+				{
+					m_kept[slot.pbo] = slot.capacity;
+					slot.pbo = 0;
+					slot.capacity = 0;
+				}
+				else
+					glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+				m_keep = false;
+			}
+			else
+				ThrowException(L"Unable to map a readback buffer", ExceptionGravity::Warning);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			slot.callback = NULL;
+			m_completing = false;
+		}
+
+		void Complete()
+		{
+			Slot& slot = m_slots[m_first];
+			if (slot.callback)
+				Deliver(slot);
+
+			//The slot is freed after the callback so a readback started from it can't take the mapped buffer
+			m_first = (m_first + 1) % RingSize;
+			m_count--;
+		}
+	};
+
+	//DO NOT USE.
+	namespace Readbacks
+	{
+		ReadbackRing* rr = NULL;
+	}
+
+	//Represents a framebuffer.
+	class Renderer
+	{
+	public:
+		inline Renderer() {}
+		//Only call after Window::Create()
+		Renderer(Size size, bool IsWindow)
+		{
+			s_renderers.push_back(this);
+			if (IsWindow)
+			{
+				m_width = size.width;
+				m_height = size.height;
+				s_wind = this;
+				m_frame = 0;
+				m_tex = 0;
+			}
+			else
+			{
+				m_width = size.width;
+				m_height = size.height;
+				glGenFramebuffers(1, &m_frame);
+				Bindings::BindFramebuffer(m_frame, m_width, m_height);
+				glGenTextures(1, &m_tex);
+				Bindings::BindTexture(m_tex);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+				glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, size.width, size.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+				glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_tex, 0);
+
+				const GLenum DrawBuffers[1] = { GL_COLOR_ATTACHMENT0 };
+				glDrawBuffers(1, DrawBuffers);
+				Fill(Color(0, 0, 0));
+			}
+		}
+
+		//DO NOT USE. This function is called when the window is resized;
+		static void UpdateWindowFramebuffer(Size size)
+		{
+			if (s_wind)
+			{
+				s_wind->m_width = size.width;
+				s_wind->m_height = size.height;
+			}
+			else
+				ThrowException(L"Unable to resize window renderer");
+		}
+
+		//Enables or disables deferred rendering. When enabled, the draws are recorded and drawn at Window::SwapBuffers(), sorted by renderer, layer, shader and texture to avoid state changes. Draws of the same layer may then be reordered, use SetLayer() to keep things on top of each other.
+		static void SetDeferred(bool enabled)
+		{
+			if (!Queueing::rq)
+				Queueing::rq = new RenderQueue();
+			if (!enabled)
+				Bindings::FlushBatch();
+			Queueing::s_recording = enabled;
+		}
+
+		//Checks if deferred rendering is enabled.
+		static inline bool IsDeferred()
+		{
+			return Queueing::s_recording;
+		}
+
+		//Sets the layer of the next draws of this renderer when deferred rendering is enabled. Lower layers are drawn first. Between -128 and 127.
+		inline void SetLayer(int layer)
+		{
+			m_layer = std::max(-128, std::min(127, layer));
+		}
+
+		//Gets the current layer of this renderer.
+		inline int GetLayer()
+		{
+			return m_layer;
+		}
+
+		//DO NOT USE. Checks if this renderer draws to the window.
+		inline bool IsWindow()
+		{
+			return m_frame == 0;
+		}
+
+		//Fills the framebuffer with a color
+		inline void Fill(Color color)
+		{
+			if (Queueing::s_recording)
+			{
+				Queueing::rq->AddFill(this, m_layer, color);
+				return;
+			}
+
+			Bind();
+			Bindings::FlushBatch();
+			if (m_frame == 0)
+			{
+				float* gl = color.ToGL();
+				glClearColor(gl[0], gl[1], gl[2], gl[3]);
+				delete[] gl;
+			}
+			else
+			{
+				Batching::sb->Add(0, 0, 0, m_width, m_height, 0, 0, 1, 1, color);
+			}
+		}
+
+		//Renders a image to this renderer output.
+		inline void Render(Image* img, vec2 pos, vecf scale = vecf(1, 1), Color backcolor = Color(255, 255, 255))
+		{
+			Bind();
+			img->Render(pos, scale, backcolor);
+		}
+
+		//Retreives the content of this renderer. This function takes some time to be processed and must be called when you're done rendering.
+		inline Image* GetContent()
+		{
+			Bindings::FlushBatch();
+			Bindings::BindFramebuffer(m_frame, m_width, m_height);
+			Image* img = new Image(Size(m_width, m_height));
+			glReadPixels(0, 0, m_width, m_height, GL_RGBA, GL_UNSIGNED_BYTE, img->GetData());
+			return img;
+		}
+
+		//Reads the content of this renderer without waiting for the GPU. The callback gets the pixels a couple of frames later, in Window::SwapBuffers(). Call this when you're done rendering.
+		inline void GetContentAsync(ReadbackCallback callback, void* userdata = NULL)
+		{
+			Bindings::FlushBatch();
+			Bindings::BindFramebuffer(m_frame, m_width, m_height);
+			Readbacks::rr->Request(Size(m_width, m_height), callback, userdata);
+		}
+
+		//Renders a terrain depending on a camera.
+		void Render(Terrain* ter, Camera* cam, TileAtlas* atlas)
+		{
+			if (Queueing::s_recording)
+			{
+				Queueing::rq->AddTerrain(this, m_layer, ter, cam, atlas);
+				return;
+			}
+
+			Bind();
+			Bindings::FlushBatch();
+			if (ter->GetRenderingMode() == TerrainRenderingMode::TileMap && ter->GetTileMap()->Render(cam, atlas))
+			{
+				//The tile map shader leaves its own texture on the light unit
+				s_lighting.texture = 0xffffffff;
+				ApplyLighting(m_lighting.terrain, m_lighting.camera, m_lighting.tilesize);
+				return;
+			}
+			ApplyLighting(ter, cam, atlas->GetTilesize());
+			if (ter->GetRenderingMode() != TerrainRenderingMode::Tiles)
+			{
+				ter->GetMesh()->Render(cam, atlas);
+				ApplyLighting(m_lighting.terrain, m_lighting.camera, m_lighting.tilesize);
+				return;
+			}
+
+			unsigned int size = atlas->GetTilesize();
+			int start_x = cam->GetX();
+			int start_y = cam->GetY();
+
+			int end_x = std::floor(start_x / (double) size) + cam->GetWidth() + 1;
+			int end_y = std::floor(start_y / (double)size) + cam->GetHeight() + 1;
+
+			//Row by row, the way the terrain is stored
+			for (int y = std::floor(start_y / (double)size) - 1; y < end_y; ++y)
+			{
+				for (int x = std::floor(start_x / (double)size) - 1; x < end_x ; ++x)
+				{
+					//#TODO - check ++i
+					for (int l = 0; l < ter->GetLayerCount(); ++l)
+					{
+						
+						unsigned int val;
+
+						bool alphaup = false;
+						for (int a = l; a < ter->GetLayerCount(); a++)
+						{ 
+							val = ter->GetTile(a, x, y);
+							if (val != 0xffffffff)
+								if (atlas->GetTile(val)->HasAlpha())
+									alphaup = true;
+						}
+
+						if (l == ter->GetLayerCount() - 1 || alphaup)
+						{ 
+							val = ter->GetTile(l, x, y);
+							if (val != 0xffffffff)
+								atlas->GetTile(val)->Render(atlas->GetTextureID(), x * size - cam->GetX(), y * size - cam->GetY(), Color(255, 255, 255));
+						}
+					}
+				}
+			}
+			ApplyLighting(m_lighting.terrain, m_lighting.camera, m_lighting.tilesize);
+		}
+
+		//Lights the images, sprites, text and meshes drawn on this renderer afterwards with the lights of a terrain seen from a camera. NULL turns it off, and so does deleting the terrain or the camera. With deferred rendering, the last lighting set is used for the whole frame.
+		inline void SetLighting(Terrain* ter, Camera* cam = NULL, TileAtlas* atlas = NULL)
+		{
+			if (ter && (!cam || !atlas))
+			{
+				ThrowException(L"Lighting needs the camera and the atlas the terrain is drawn with", ExceptionGravity::Warning);
+				return;
+			}
+			m_lighting = { ter, cam, ter ? atlas->GetTilesize() : 0 };
+		}
+
+		//Renders the loaded chunks of a world depending on a camera.
+		inline void Render(TerrainWorld* world, Camera* cam, TileAtlas* atlas)
+		{
+			Bind();
+			world->Render(cam, atlas);
+		}
+
+		//Renders a geometry mesh. DO NOT USE isprogress.
+		inline void Render(GeometryMesh* mesh, Color color, GeometryRenderingMode mode, vec2 pos, vecf scale = vecf(1, 1))
+		{
+			if (Queueing::s_recording)
+			{
+				Queueing::rq->AddMesh(this, m_layer, mesh, color, mode, pos, scale);
+				return;
+			}
+
+			Bind();
+			Bindings::FlushBatch();
+			Shaders::ts->SetShaderType(ShaderType::ColorOnly);
+			Shaders::ts->SetColor(color);
+			//DONT SET POS
+			Shaders::ts->SetScale(scale);
+			mesh->Render(mode, pos.x, pos.y);
+		}
+
+		//Renders the content of another renderer.
+		inline void Render(Renderer* renderer, Color color, vec2 pos, vecf scale = vecf(1, 1))
+		{
+			Bind();
+			//The framebuffer texture is upside down
+			Batching::sb->Add(renderer->m_tex, pos.x, pos.y, renderer->m_width * scale.x, renderer->m_height * scale.y, 0, 1, 1, 0, color);
+		}
+
+		//Renders a string with a font.
+		inline void Render(std::wstring string, Font* font, vec2 pos, Color color = Color(255, 255, 255))
+		{
+			Bind();
+			for (int i = 0; i < string.length(); i++)
+			{
+				vec2 vec = font->RenderGlyph(string[i], pos.x, pos.y, color);
+				pos.x += vec.x;
+				pos.y += vec.y;
+			}
+		}
+
+		//Renders a sprite.
+		inline void Render(Sprite* sprite, vec2 pos, vecf scale = vecf(1, 1), Color color = Color(255, 255, 255))
+		{
+			Bind();
+			sprite->Render(pos, scale, color);
+		}
+
+		//Renders a particle. Can be used but ParticleInstancer may be more practicle.
+		inline void Render(ParticleCore* core, ParticleInstance* particle)
+		{
+			Bind();
+			particle->Render(core);
+		}
+
+		//Renders all the particles in a instancer.
+		inline void Render(ParticleInstanciator* instanciator)
+		{
+			Bind();
+			instanciator->Render();
+		}
+
+		//Renders an UI element
+		inline void Render(UIElement* element)
+		{
+			element->Render(this);
+		}
+
+		inline ~Renderer() {
+			Bindings::FlushBatch();
+			s_renderers.erase(std::remove(s_renderers.begin(), s_renderers.end(), this), s_renderers.end());
+			if (m_frame != 0)
+				glDeleteFramebuffers(1, &m_frame);
+			if (m_tex != 0)
+				glDeleteTextures(1, &m_tex);
+		}
+
+	private:
+		struct Lighting
+		{
+			Terrain* terrain;
+			Camera* camera;
+			unsigned int tilesize;
+		};
+
+		//What the texture shader is lit with
+		struct LightingState
+		{
+			unsigned int texture;
+			float x, y, sx, sy;
+		};
+
+		unsigned int m_frame, m_tex, m_width, m_height;
+		int m_layer = 0;
+		//Cleared by Bindings::ForgetLighting() when the terrain or the camera is deleted
+		Lighting m_lighting = { NULL, NULL, 0 };
+		static unsigned int m_bound;
+		static Renderer* s_wind;
+		static LightingState s_lighting;
+		//Every renderer created, so deleted terrains and cameras can be taken out of their lighting
+		static std::vector<Renderer*> s_renderers;
+
+		friend class RenderQueue;
+		friend void Bindings::ForgetLighting(const void* object);
+
+		inline void Bind()
+		{		
+			if (Queueing::s_recording)
+				Queueing::rq->SetTarget(this, m_layer);
+			else
+			{
+				Bindings::BindFramebuffer(m_frame, m_width, m_height);
+				ApplyLighting(m_lighting.terrain, m_lighting.camera, m_lighting.tilesize);
+			}
 		}
 
-	private:
-		vec2 pos;
+		//Lights the next draws with a terrain, drawing the batch first if that changes anything. The light texture only uploads the chunks whose lights changed.
+		static void ApplyLighting(Terrain* ter, Camera* cam, unsigned int tilesize)
+		{
+			LightingState state = { 0, 0, 0, 0, 0 };
+			if (ter)
+			{
+				//The texture may only hold the part of the terrain around the camera
+				TerrainLightTexture* light = ter->GetLightTexture();
+				state.texture = light->Update(cam, tilesize);
+				if (state.texture)
+				{
+					state.x = (float)cam->GetX() - (float)light->GetX() * tilesize;
+					state.y = (float)cam->GetY() - (float)light->GetY() * tilesize;
+					state.sx = 1.0f / (tilesize * light->GetWidth());
+					state.sy = 1.0f / (tilesize * light->GetHeight());
+				}
+			}
+			if (state.texture == s_lighting.texture && (!state.texture || (state.x == s_lighting.x && state.y == s_lighting.y && state.sx == s_lighting.sx && state.sy == s_lighting.sy)))
+				return;
+			Bindings::FlushBatch();
+			s_lighting = state;
+			Shaders::ts->Use();
+			Shaders::ts->SetLighting(state.texture, state.x, state.y, state.sx, state.sy);
+		}
 	};
+	unsigned int Renderer::m_bound;
+	Renderer* Renderer::s_wind;
+	Renderer::LightingState Renderer::s_lighting = { 0, 0, 0, 0, 0 };
+	std::vector<Renderer*> Renderer::s_renderers;
+
+	void Bindings::ForgetLighting(const void* object)
+	{
+		for (Renderer* renderer : Renderer::s_renderers)
+			if (renderer->m_lighting.terrain == object || renderer->m_lighting.camera == object)
+				renderer->m_lighting = { NULL, NULL, 0 };
+		//The texture of a deleted terrain may be bound to the light unit, and its name reused
+		Renderer::s_lighting.texture = 0xffffffff;
+	}
+
+	inline RenderQueue::Command& RenderQueue::Add(Renderer* target, int layer, CommandType type, unsigned int tex, unsigned int vao)
+	{
+		//The window is drawn after every other renderer so their content is ready when it is drawn on it
+		unsigned long long slot = 255;
+		if (!target->IsWindow())
+		{
+			auto it = std::find(m_targets.begin(), m_targets.end(), target);
+			if (it == m_targets.end())
+			{
+				if (m_targets.size() == 255)
+					Submit();
+				m_targets.push_back(target);
+				it = m_targets.end() - 1;
+			}
+			slot = it - m_targets.begin();
+		}
+
+		//8 bits of renderer, 8 of layer, 4 of type, 24 of texture and 20 of VAO
+		unsigned long long key = slot << 56 | (unsigned long long)(layer + 128) << 48 | (unsigned long long)type << 44 | (unsigned long long)(tex & 0xffffff) << 20 | (vao & 0xfffff);
+		m_keys.push_back({ key, (unsigned int)m_commands.size() });
+		m_commands.push_back(Command());
+		Command& c = m_commands.back();
+		c.target = target;
+		c.type = type;
+		c.tex = tex;
+		return c;
+	}
+
+	inline void RenderQueue::Submit()
+	{
+		if (m_submitting || m_commands.empty())
+			return;
+		m_submitting = true;
+		bool recording = Queueing::s_recording;
+		Queueing::s_recording = false;
+
+		Sort();
+		for (auto& key : m_keys)
+		{
+			Command& c = m_commands[key.second];
+			switch (c.type)
+			{
+			case FillCommand:
+				c.target->Fill(c.color);
+				break;
+			case TerrainCommand:
+			{
+				TerrainDraw& draw = m_terrains[c.index];
+				m_camera.SetPosition(draw.x, draw.y);
+				m_camera.SetSize(draw.size);
+				c.target->Render(draw.ter, &m_camera, draw.atlas);
+				break;
+			}
+			case MeshCommand:
+				c.target->Render(m_meshes[c.index].mesh, c.color, m_meshes[c.index].mode, m_meshes[c.index].pos, m_meshes[c.index].scale);
+				break;
+			default:
+				c.target->Bind();
+				Batching::sb->Add(c.tex, c.x, c.y, c.w, c.h, c.u1, c.v1, c.u2, c.v2, c.color);
+				break;
+			}
+		}
+
+		m_commands.clear();
+		m_terrains.clear();
+		m_meshes.clear();
+		m_targets.clear();
+		m_keys.clear();
+		Queueing::s_recording = recording;
+		m_submitting = false;
+	}
+
+	void Queueing::RecordQuad(unsigned int tex, float x, float y, float w, float h, float u1, float v1, float u2, float v2, Color color)
+	{
+		rq->AddQuad(tex, x, y, w, h, u1, v1, u2, v2, color);
+	}
+
+	void Queueing::Submit()
+	{
+		if (rq)
+			rq->Submit();
+	}
 	
-	//Represents a framebuffer.
-	class Renderer
+	//Draws images, sprites, text, geometry meshes and terrains into an image on the CPU. It doesn't need a window or a GPU so it can make minimaps and thumbnails on servers.
+	//Images, sprites and fonts must keep their pixels to be drawn by it (see their retain parameter). The draws are recorded and done by several threads when the content is retrieved.
+	//Deleting an image, sprite, font, atlas or mesh draws what was recorded with it first, on the thread deleting it. A renderer used on another thread must be flushed by it before what it draws is deleted.
+	class SoftwareRenderer
 	{
+		struct Command
+		{
+			Image* src;
+			GeometryMesh* mesh;
+			GeometryRenderingMode mode;
+			float x, y, w, h, u1, v1, u2, v2;
+			vecf scale;
+			Color color;
+			int x1, y1, x2, y2;
+		};
+
 	public:
-		inline Renderer() {}
-		//Only call after Window::Create()
-		Renderer(Size size, bool IsWindow)
+		//The side in pixels of the squares the output is split in. Each square is drawn by one thread.
+		static const int TileSize = 64;
+
+		inline SoftwareRenderer() {}
+		SoftwareRenderer(Size size)
+		{
+			m_width = size.width;
+			m_height = size.height;
+			m_target = new Image(size);
+			m_tilesx = (m_width + TileSize - 1) / TileSize;
+			m_tilesy = (m_height + TileSize - 1) / TileSize;
+			m_bins = std::vector<std::vector<unsigned int>>(m_tilesx * m_tilesy);
+			std::lock_guard<std::mutex> lock(s_mutex);
+			s_renderers.push_back(this);
+		}
+
+		~SoftwareRenderer()
 		{
-			if (IsWindow)
 			{
-				m_width = size.width;
-				m_height = size.height;
-				s_wind = this;
-				m_frame = 0;
-				m_tex = 0;
+				std::lock_guard<std::mutex> lock(s_mutex);
+				s_renderers.erase(std::remove(s_renderers.begin(), s_renderers.end(), this), s_renderers.end());
 			}
-			else
+			if (m_target)
+				delete m_target;
+		}
+
+		//Fills the output with a color. Like an off-screen Renderer, the color is blended over the content.
+		inline void Fill(Color color)
+		{
+			AddQuad(NULL, 0, 0, m_width, m_height, 0, 0, 1, 1, color);
+		}
+
+		//Renders an image.
+		inline void Render(Image* img, vec2 pos, vecf scale = vecf(1, 1), Color backcolor = Color(255, 255, 255))
+		{
+			if (!img->GetData())
 			{
-				m_width = size.width;
-				m_height = size.height;
-				glGenFramebuffers(1, &m_frame);
-				Bind();
-				glGenTextures(1, &m_tex);
-				glBindTexture(GL_TEXTURE_2D, m_tex);
-				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-				glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, size.width, size.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
-				glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_tex, 0);
+				ThrowException(L"This image has no pixels to draw. Finalize it with retain set to true.", ExceptionGravity::Warning);
+				return;
+			}
+			AddQuad(img, pos.x, pos.y, img->GetWidth() * scale.x, img->GetHeight() * scale.y, 0, 0, 1, 1, backcolor);
+		}
+
+		//Renders a sprite.
+		inline void Render(Sprite* sprite, vec2 pos, vecf scale = vecf(1, 1), Color color = Color(255, 255, 255))
+		{
+			if (!sprite->m_pixels)
+			{
+				ThrowException(L"This sprite has no pixels to draw. Create it with retain set to true.", ExceptionGravity::Warning);
+				return;
+			}
+			AddQuad(sprite->m_pixels, pos.x, pos.y, sprite->m_width * scale.x, sprite->m_height * scale.y, sprite->m_u[sprite->m_state * 2], 0, sprite->m_u[sprite->m_state * 2 + 1], 1, color);
+		}
 
-				//VAO
-				glGenVertexArrays(1, &m_vao);
-				Bindings::BindVAO(m_vao);
+		//Renders a string with a font.
+		void Render(std::wstring string, Font* font, vec2 pos, Color color = Color(255, 255, 255))
+		{
+			if (!font->m_pixels)
+			{
+				ThrowException(L"This font has no pixels to draw. Create it with retain set to true.", ExceptionGravity::Warning);
+				return;
+			}
 
-				HALF_VERT vecs[12] =
+			for (unsigned int i = 0; i < string.length(); i++)
+			{
+				if (string[i] == L'\n')
 				{
-					0, 0,
-					(int)m_width, (int)m_height,
-					(int)m_width, 0,
-					0, 0,
-					(int)m_width, (int)m_height,
-					0, (int)m_height
-				};
+					pos.x = 0;
+					pos.y += font->m_max;
+				}
+				else if (string[i] == L'\t')
+					pos.x += font->m_glyphs[9].adv;
+				else
+				{
+					Font::Glyph& g = font->m_glyphs[string[i]];
+					AddQuad(font->m_pixels, pos.x + (int)g.x, font->m_max + (int)g.y + pos.y, g.w, g.h, (float)g.xoff / font->m_tw, 0, (float)(g.xoff + g.w) / font->m_tw, (float)g.h / font->m_th, color);
+					pos.x += g.adv;
+				}
+			}
+		}
 
-				float tcs[12] = {
-					0, 1,
-					1, 0,
-					1, 1,
-					0, 1,
-					1, 0,
-					0, 0
-				};
+		//Renders a geometry mesh.
+		void Render(GeometryMesh* mesh, Color color, GeometryRenderingMode mode, vec2 pos, vecf scale = vecf(1, 1))
+		{
+			const std::vector<HALF_VERT>& points = mesh->GetPoints();
+			if (points.size() < 4)
+				return;
 
-				//VBO
-				glGenBuffers(1, &m_vbo);
-				glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-				glBufferData(GL_ARRAY_BUFFER, sizeof(vecs), vecs, GL_STATIC_DRAW);
-				glVertexAttribPointer(0, 2, VERTEX_TYPE, GL_FALSE, sizeof(int) * 2, NULL);
+			float minx = points[0] * scale.x, maxx = minx, miny = points[1] * scale.y, maxy = miny;
+			for (unsigned int i = 2; i + 1 < points.size(); i += 2)
+			{
+				minx = std::min(minx, points[i] * scale.x);
+				maxx = std::max(maxx, points[i] * scale.x);
+				miny = std::min(miny, points[i + 1] * scale.y);
+				maxy = std::max(maxy, points[i + 1] * scale.y);
+			}
 
-				glGenBuffers(1, &m_tbo);
-				glBindBuffer(GL_ARRAY_BUFFER, m_tbo);
-				glBufferData(GL_ARRAY_BUFFER, sizeof(tcs), tcs, GL_STATIC_DRAW);
-				glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 2, NULL);
-				glBindBuffer(GL_ARRAY_BUFFER, 0);
+			Command c;
+			c.src = NULL;
+			c.mesh = mesh;
+			c.mode = mode;
+			c.x = pos.x;
+			c.y = pos.y;
+			c.scale = scale;
+			c.color = color;
+			c.x1 = std::max(0, (int)std::floor(pos.x + minx) - 1);
+			c.y1 = std::max(0, (int)std::floor(pos.y + miny) - 1);
+			c.x2 = std::min((int)m_width, (int)std::ceil(pos.x + maxx) + 1);
+			c.y2 = std::min((int)m_height, (int)std::ceil(pos.y + maxy) + 1);
+			if (c.x1 < c.x2 && c.y1 < c.y2)
+				m_commands.push_back(c);
+		}
+
+		//Renders a terrain depending on a camera. The tiles are drawn like the Tiles rendering mode of the Renderer.
+		void Render(Terrain* ter, Camera* cam, TileAtlas* atlas)
+		{
+			Image* pixels = atlas->GetImage();
+			float size = atlas->GetTilesize();
+			float aw = pixels->GetWidth(), ah = pixels->GetHeight();
+			int start_x = cam->GetX();
+			int start_y = cam->GetY();
 
-				const GLenum DrawBuffers[1] = { GL_COLOR_ATTACHMENT0 };
-				glDrawBuffers(1, DrawBuffers);
-				Fill(Color(0, 0, 0));
+			int end_x = std::floor(start_x / (double)size) + cam->GetWidth() + 1;
+			int end_y = std::floor(start_y / (double)size) + cam->GetHeight() + 1;
+
+			for (int y = std::floor(start_y / (double)size) - 1; y < end_y; ++y)
+			{
+				for (int x = std::floor(start_x / (double)size) - 1; x < end_x; ++x)
+				{
+					for (unsigned int l = 0; l < ter->GetLayerCount(); ++l)
+					{
+						unsigned int val;
+
+						bool alphaup = false;
+						for (unsigned int a = l; a < ter->GetLayerCount(); a++)
+						{
+							val = ter->GetTile(a, x, y);
+							if (val != 0xffffffff)
+								if (atlas->GetTile(val)->HasAlpha())
+									alphaup = true;
+						}
+
+						if (l == ter->GetLayerCount() - 1 || alphaup)
+						{
+							val = ter->GetTile(l, x, y);
+							if (val != 0xffffffff)
+							{
+								Tile* tile = atlas->GetTile(val);
+								vec2 cell = tile->GetAtlasLocation(tile->GetAnimationState());
+								AddQuad(pixels, x * size - cam->GetX(), y * size - cam->GetY(), size, size, cell.x * size / aw, cell.y * size / ah, (cell.x + 1) * size / aw, (cell.y + 1) * size / ah, ter->GetLightColor(x, y));
+							}
+						}
+					}
+				}
 			}
 		}
 
-		//DO NOT USE. This function is called when the window is resized;
-		static void UpdateWindowFramebuffer(Size size)
+		//Draws everything that was rendered since the last call.
+		void Flush()
 		{
-			if (s_wind)
+			if (m_commands.empty())
+				return;
+
+			for (auto& bin : m_bins)
+				bin.clear();
+			for (unsigned int i = 0; i < m_commands.size(); i++)
 			{
-				s_wind->m_width = size.width;
-				s_wind->m_height = size.height;
+				Command& c = m_commands[i];
+				for (int ty = c.y1 / TileSize; ty <= (c.y2 - 1) / TileSize; ty++)
+					for (int tx = c.x1 / TileSize; tx <= (c.x2 - 1) / TileSize; tx++)
+						m_bins[ty * m_tilesx + tx].push_back(i);
 			}
-			else
-				ThrowException(L"Unable to resize window renderer");
+
+			//Every square is drawn by one thread in the order of the draws so the result doesn't depend on the thread count
+			std::atomic<unsigned int> next(0);
+			auto work = [this, &next]()
+			{
+				for (unsigned int t = next++; t < m_bins.size(); t = next++)
+					DrawTile(t);
+			};
+			unsigned int threads = std::min<unsigned int>(Hardware::GetThreadCount(), m_bins.size());
+			std::vector<std::thread> workers;
+			for (unsigned int i = 1; i < threads; i++)
+				workers.push_back(std::thread(work));
+			work();
+			for (auto& worker : workers)
+				worker.join();
+
+			m_commands.clear();
 		}
 
-		//Fills the framebuffer with a color
-		inline void Fill(Color color)
+		//Draws everything and returns a copy of the output. Delete it after using it.
+		inline Image* GetContent()
 		{
-			Bind();
-			if (m_frame == 0)
+			Flush();
+			Image* img = new Image(Size(m_width, m_height));
+			memcpy(img->GetData(), m_target->GetData(), m_width * m_height * 4);
+			return img;
+		}
+
+		//DO NOT USE. Blends count source pixels over the destination pixels like glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA).
+		static inline void Blend(unsigned char* dst, const unsigned char* src, int count)
+		{
+			int i = 0;
+#ifdef GIZEGO_SSE2
+			const __m128i zero = _mm_setzero_si128(), full = _mm_set1_epi16(255), half = _mm_set1_epi16(128);
+			for (; i + 4 <= count; i += 4)
 			{
-				float* gl = color.ToGL();
-				glClearColor(gl[0], gl[1], gl[2], gl[3]);
-				delete[] gl;
+				__m128i s = _mm_loadu_si128((const __m128i*)(src + i * 4));
+				__m128i d = _mm_loadu_si128((const __m128i*)(dst + i * 4));
+				__m128i slo = _mm_unpacklo_epi8(s, zero), shi = _mm_unpackhi_epi8(s, zero);
+				__m128i dlo = _mm_unpacklo_epi8(d, zero), dhi = _mm_unpackhi_epi8(d, zero);
+				//The alpha of each pixel copied in its 4 channels
+				__m128i alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(slo, 0xff), 0xff);
+				__m128i ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(shi, 0xff), 0xff);
+				__m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(slo, alo), _mm_mullo_epi16(dlo, _mm_sub_epi16(full, alo))), half);
+				__m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(shi, ahi), _mm_mullo_epi16(dhi, _mm_sub_epi16(full, ahi))), half);
+				//Divides by 255 with rounding
+				lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+				hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+				_mm_storeu_si128((__m128i*)(dst + i * 4), _mm_packus_epi16(lo, hi));
+			}
+#endif
+			for (; i < count; i++)
+			{
+				unsigned int a = src[i * 4 + 3];
+				for (int f = 0; f < 4; f++)
+				{
+					unsigned int v = src[i * 4 + f] * a + dst[i * 4 + f] * (255 - a) + 128;
+					dst[i * 4 + f] = (v + (v >> 8)) >> 8;
+				}
+			}
+		}
+
+	private:
+		Image* m_target = NULL;
+		unsigned int m_width, m_height, m_tilesx, m_tilesy;
+		std::vector<Command> m_commands;
+		std::vector<std::vector<unsigned int>> m_bins;
+		//Every software renderer created, so the images and meshes being deleted can be drawn first. They can be created on any thread.
+		static std::vector<SoftwareRenderer*> s_renderers;
+		static std::mutex s_mutex;
+
+		friend void Bindings::FlushSoftware(const void* object);
+
+		//Checks if a recorded draw uses an image or a mesh.
+		bool Uses(const void* object)
+		{
+			for (auto& c : m_commands)
+				if (c.src == object || c.mesh == object)
+					return true;
+			return false;
+		}
+
+		void AddQuad(Image* src, float x, float y, float w, float h, float u1, float v1, float u2, float v2, Color color)
+		{
+			//Negative scales mirror the quad
+			if (w < 0)
+			{
+				x += w;
+				w = -w;
+				std::swap(u1, u2);
+			}
+			if (h < 0)
+			{
+				y += h;
+				h = -h;
+				std::swap(v1, v2);
+			}
+
+			Command c;
+			c.src = src;
+			c.mesh = NULL;
+			c.x = x; c.y = y; c.w = w; c.h = h;
+			c.u1 = u1; c.v1 = v1; c.u2 = u2; c.v2 = v2;
+			c.color = color;
+			//The pixels whose center is inside the quad, like OpenGL
+			c.x1 = std::max(0, (int)std::ceil(x - 0.5f));
+			c.y1 = std::max(0, (int)std::ceil(y - 0.5f));
+			c.x2 = std::min((int)m_width, (int)std::ceil(x + w - 0.5f));
+			c.y2 = std::min((int)m_height, (int)std::ceil(y + h - 0.5f));
+			if (c.x1 < c.x2 && c.y1 < c.y2)
+				m_commands.push_back(c);
+		}
+
+		void DrawTile(unsigned int t)
+		{
+			int cx1 = (t % m_tilesx) * TileSize, cy1 = (t / m_tilesx) * TileSize;
+			int cx2 = std::min(cx1 + TileSize, (int)m_width), cy2 = std::min(cy1 + TileSize, (int)m_height);
+			for (unsigned int i : m_bins[t])
+			{
+				Command& c = m_commands[i];
+				int x1 = std::max(c.x1, cx1), y1 = std::max(c.y1, cy1), x2 = std::min(c.x2, cx2), y2 = std::min(c.y2, cy2);
+				if (c.mesh)
+					DrawMesh(c, x1, y1, x2, y2);
+				else
+					DrawQuad(c, x1, y1, x2, y2);
+			}
+		}
+
+		void DrawQuad(Command& c, int x1, int y1, int x2, int y2)
+		{
+			Color span[TileSize];
+			const unsigned char* tex = c.src ? c.src->GetData() : NULL;
+			int tw = c.src ? c.src->GetWidth() : 0, th = c.src ? c.src->GetHeight() : 0;
+
+			for (int py = y1; py < y2; py++)
+			{
+				const unsigned char* row = NULL;
+				if (tex)
+				{
+					int ty = std::floor((c.v1 + (py + 0.5f - c.y) / c.h * (c.v2 - c.v1)) * th);
+					row = tex + std::max(0, std::min(th - 1, ty)) * tw * 4;
+				}
+				for (int px = x1; px < x2; px++)
+				{
+					if (!row)
+					{
+						span[px - x1] = c.color;
+						continue;
+					}
+					int tx = std::floor((c.u1 + (px + 0.5f - c.x) / c.w * (c.u2 - c.u1)) * tw);
+					const unsigned char* texel = row + std::max(0, std::min(tw - 1, tx)) * 4;
+					span[px - x1] = Color((texel[0] * c.color.R + 127) / 255, (texel[1] * c.color.G + 127) / 255, (texel[2] * c.color.B + 127) / 255, (texel[3] * c.color.A + 127) / 255);
+				}
+				Blend(m_target->GetData() + (py * m_width + x1) * 4, (unsigned char*)span, x2 - x1);
+			}
+		}
+
+		void DrawMesh(Command& c, int x1, int y1, int x2, int y2)
+		{
+			const std::vector<HALF_VERT>& points = c.mesh->GetPoints();
+			unsigned int count = points.size() / 2;
+			auto vertex = [&](unsigned int i) { return vecf(points[i * 2] * c.scale.x + c.x, points[i * 2 + 1] * c.scale.y + c.y); };
+
+			if (c.mode == GeometryRenderingMode::FillTriangles)
+			{
+				for (unsigned int i = 0; i + 2 < count; i++)
+					FillTriangle(vertex(i), vertex(i + 1), vertex(i + 2), c.color, x1, y1, x2, y2);
 			}
 			else
 			{
-				Shaders::ts->SetShaderType(ShaderType::ColorOnly);
-				Bindings::BindVAO(m_vao);
-				Shaders::ts->SetColor(color);
-				glDrawArrays(GL_TRIANGLES, 0, 12);
+				for (unsigned int i = 0; i + 1 < count; i += 2)
+					DrawLine(vertex(i), vertex(i + 1), c.color, x1, y1, x2, y2);
 			}
 		}
 
-		//Renders a image to this renderer output.
-		inline void Render(Image* img, vec2 pos, vecf scale = vecf(1, 1), Color backcolor = Color(255, 255, 255))
+		static inline float Edge(vecf a, vecf b, float x, float y)
+		{
+			return (b.x - a.x) * (y - a.y) - (b.y - a.y) * (x - a.x);
+		}
+
+		void FillTriangle(vecf a, vecf b, vecf c, Color color, int x1, int y1, int x2, int y2)
+		{
+			float area = Edge(a, b, c.x, c.y);
+			if (area == 0)
+				return;
+			if (area < 0)
+				std::swap(b, c);
+
+			x1 = std::max(x1, (int)std::floor(std::min({ a.x, b.x, c.x })));
+			x2 = std::min(x2, (int)std::ceil(std::max({ a.x, b.x, c.x })));
+			y1 = std::max(y1, (int)std::floor(std::min({ a.y, b.y, c.y })));
+			y2 = std::min(y2, (int)std::ceil(std::max({ a.y, b.y, c.y })));
+
+			Color span[TileSize];
+			for (int i = 0; i < TileSize; i++)
+				span[i] = color;
+			for (int py = y1; py < y2; py++)
+			{
+				//The covered pixels of a row are next to each other because the triangle is convex
+				int first = -1, last = -1;
+				for (int px = x1; px < x2; px++)
+				{
+					float x = px + 0.5f, y = py + 0.5f;
+					//The right and bottom edges are left out so the triangles of a strip don't blend twice
+					if (Inside(a, b, x, y) && Inside(b, c, x, y) && Inside(c, a, x, y))
+					{
+						if (first < 0)
+							first = px;
+						last = px;
+					}
+				}
+				if (first >= 0)
+					Blend(m_target->GetData() + (py * m_width + first) * 4, (unsigned char*)span, last - first + 1);
+			}
+		}
+
+		static inline bool Inside(vecf a, vecf b, float x, float y)
+		{
+			float e = Edge(a, b, x, y);
+			return e > 0 || (e == 0 && (b.y > a.y || (b.y == a.y && b.x < a.x)));
+		}
+
+		void DrawLine(vecf a, vecf b, Color color, int x1, int y1, int x2, int y2)
+		{
+			int steps = std::ceil(std::max(std::abs(b.x - a.x), std::abs(b.y - a.y)));
+			for (int i = 0; i <= steps; i++)
+			{
+				float t = steps ? (float)i / steps : 0;
+				int px = std::floor(a.x + (b.x - a.x) * t), py = std::floor(a.y + (b.y - a.y) * t);
+				if (px >= x1 && px < x2 && py >= y1 && py < y2)
+					Blend(m_target->GetData() + (py * m_width + px) * 4, (unsigned char*)&color, 1);
+			}
+		}
+	};
+
+	std::vector<SoftwareRenderer*> SoftwareRenderer::s_renderers;
+	std::mutex SoftwareRenderer::s_mutex;
+
+	void Bindings::FlushSoftware(const void* object)
+	{
+		std::lock_guard<std::mutex> lock(SoftwareRenderer::s_mutex);
+		for (SoftwareRenderer* renderer : SoftwareRenderer::s_renderers)
+			if (renderer->Uses(object))
+				renderer->Flush();
+	}
+
+	//PNG, QOI or raw RGBA files.
+	enum CaptureFormat : char
+	{
+		PNGSequence, QOISequence, RawSequence
+	};
+
+	//Records every Nth frame of a renderer to numbered files in a directory. The frames are read without waiting for the GPU and copied and written by worker threads, so the game never waits for compression or the disk.
+	//When the queue is full the frame is dropped and counted. Only the frames that are kept are numbered, so the files have no gaps for dropped frames.
+	class FrameRecorder
+	{
+		struct Frame
+		{
+			unsigned long long index;
+			Size size;
+			//The mapped readback buffer, until a worker copied it to pixels
+			unsigned int pbo;
+			const unsigned char* mapped;
+			std::vector<unsigned char> pixels;
+		};
+
+	public:
+		inline FrameRecorder() {}
+
+		//The directory must exist. interval is the number of frames between captures, queuesize the number of frames that can wait to be written. Stop the recorder before CloseEngine().
+		FrameRecorder(Renderer* renderer, std::wstring directory, CaptureFormat format, unsigned int interval = 1, unsigned int queuesize = 8, unsigned int threads = 2)
 		{
-			Bind();
-			Shaders::ts->SetShaderType(ShaderType::Textured);
-			Shaders::ts->SetColor(backcolor);
-			Shaders::ts->SetPosition(pos);
-			Shaders::ts->SetScale(scale);
-			img->Render();
+			m_renderer = renderer;
+			m_directory = directory;
+			m_format = format;
+			m_interval = std::max(1u, interval);
+			m_queuesize = std::max(1u, queuesize);
+			m_threadcount = std::max(1u, threads);
 		}
 
-		//Retreives the content of this renderer. This function takes some time to be processed and must be called when you're done rendering.
-		inline Image* GetContent()
+		~FrameRecorder()
 		{
-			Bind();
-			Image* img = new Image(Size(m_width, m_height));
-			glReadPixels(0, 0, m_width, m_height, GL_RGBA, GL_UNSIGNED_BYTE, img->GetData());
-			return img;
+			Stop();
 		}
 
-		//Renders a terrain depending on a camera.
-		void Render(Terrain* ter, Camera* cam, TileAtlas* atlas)
+		//Starts recording. The worker threads are created here.
+		void Start()
 		{
-			Bindings::BindTexture(atlas->GetTextureID());
-			Shaders::ts->SetShaderType(ShaderType::Textured);
-			Shaders::ts->SetScale(vecf(1, 1));
-
-			unsigned int size = atlas->GetTilesize();
-			int start_x = cam->GetX();
-			int start_y = cam->GetY();
-
-			int end_x = std::floor(start_x / (double) size) + cam->GetWidth() + 1;
-			int end_y = std::floor(start_y / (double)size) + cam->GetHeight() + 1;
+			if (m_running)
+				return;
+			m_running = true;
+			m_frame = 0;
+			for (unsigned int i = 0; i < m_threadcount; i++)
+				m_workers.push_back(std::thread(&FrameRecorder::Work, this));
+		}
 
-			for (int x = std::floor(start_x / (double)size) - 1; x < end_x ; ++x)
+		//Stops recording and waits until the frames in the queue are written.
+		void Stop()
+		{
+			if (!m_running)
+				return;
+			//Frames of this recorder still in the readback ring would come back after it is gone
+			if (Readbacks::rr)
+				Readbacks::rr->Finish(this);
 			{
-				for (int y = std::floor(start_y / (double)size) - 1; y < end_y; ++y)
-				{
-					//#TODO - check ++i
-					for (int l = 0; l < ter->GetLayerCount(); ++l)
-					{
-						
-						unsigned int val;
-
-						bool alphaup = false;
-						for (int a = l; a < ter->GetLayerCount(); a++)
-						{ 
-							val = ter->GetTile(a, x, y);
-							if (val != 0xffffffff)
-								if (atlas->GetTile(val)->HasAlpha())
-									alphaup = true;
-						}
-
-						if (l == ter->GetLayerCount() - 1 || alphaup)
-						{ 
-							val = ter->GetTile(l, x, y);
-							if (val != 0xffffffff)
-							{ 
-								Shaders::ts->SetColor(ter->GetLightMap()->GetTileColor(x, y));
-								atlas->GetTile(val)->Render(x * size - cam->GetX() , y  * size - cam->GetY());
-							}
-						}
-					}
-				}
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_running = false;
 			}
+			m_condition.notify_all();
+			for (auto& worker : m_workers)
+				worker.join();
+			m_workers.clear();
+			ReleaseBuffers();
 		}
 
-		//Renders a geometry mesh. DO NOT USE isprogress.
-		inline void Render(GeometryMesh* mesh, Color color, GeometryRenderingMode mode, vec2 pos, vecf scale = vecf(1, 1))
+		//Call this every frame after rendering and before Window::SwapBuffers().
+		void Update()
 		{
-			Bind();
-			Shaders::ts->SetShaderType(ShaderType::ColorOnly);
-			Shaders::ts->SetColor(color);
-			//DONT SET POS
-			Shaders::ts->SetScale(scale);
-			mesh->Render(mode, pos.x, pos.y);
+			ReleaseBuffers();
+			if (m_running && m_frame++ % m_interval == 0)
+			{
+				m_requested++;
+				m_renderer->GetContentAsync(Receive, this);
+			}
 		}
 
-		//Renders the content of another renderer.
-		inline void Render(Renderer* renderer, Color color, vec2 pos, vecf scale = vecf(1, 1))
+		//Checks if the recorder is running.
+		inline bool IsRecording()
 		{
-			Bind();
-			Shaders::ts->SetShaderType(ShaderType::Textured);
-			renderer->BindForRendering();
-			Shaders::ts->SetColor(color);
-			Shaders::ts->SetPosition(pos);
-			Shaders::ts->SetScale(scale);
-			glDrawArrays(GL_TRIANGLES, 0, 12);
+			return m_running;
 		}
 
-		//Renders a string with a font.
-		inline void Render(std::wstring string, Font* font, vec2 pos, Color color = Color(255, 255, 255))
+		//Returns the number of frames that were captured.
+		inline unsigned long long GetCapturedCount()
 		{
-			Bind();
-			Shaders::ts->SetShaderType(ShaderType::Textured);
-			Shaders::ts->SetColor(color);
-			Shaders::ts->SetScale(vecf(1, 1));
-			for (int i = 0; i < string.length(); i++)
-			{
-				vec2 vec = font->RenderGlyph(string[i], pos.x, pos.y);
-				pos.x += vec.x;
-				pos.y += vec.y;
-				Shaders::ts->SetPosition(pos);
-			}
+			return m_requested;
 		}
 
-		//Renders a sprite.
-		inline void Render(Sprite* sprite, vec2 pos, vecf scale = vecf(1, 1), Color color = Color(255, 255, 255))
+		//Returns the number of frames that were dropped because the queue was full.
+		inline unsigned long long GetDroppedCount()
 		{
-			Bind();
-			Shaders::ts->SetShaderType(ShaderType::Textured);
-			Shaders::ts->SetPosition(pos);
-			Shaders::ts->SetColor(color);
-			Shaders::ts->SetScale(scale);
-			sprite->Render();
+			return m_dropped;
 		}
 
-		//Renders a particle. Can be used but ParticleInstancer may be more practicle.
-		inline void Render(ParticleCore* core, ParticleInstance* particle)
+		//Returns the number of frames written to disk.
+		inline unsigned long long GetWrittenCount()
 		{
-			Bind();
-			core->RenderCore();
-			particle->Render();
-			glDrawArrays(GL_TRIANGLES, 0, 12);
+			return m_written;
 		}
 
-		//Renders all the particles in a instancer.
-		inline void Render(ParticleInstanciator* instanciator)
+		//Returns the number of frames that couldn't be written.
+		inline unsigned long long GetFailedCount()
 		{
-			Bind();
-			instanciator->Render();
+			return m_failed;
 		}
 
-		//Renders an UI element
-		inline void Render(UIElement* element)
+	private:
+		Renderer* m_renderer;
+		std::wstring m_directory;
+		CaptureFormat m_format;
+		unsigned int m_interval, m_queuesize, m_threadcount;
+		unsigned long long m_frame = 0, m_requested = 0, m_received = 0;
+		std::atomic<unsigned long long> m_dropped{ 0 }, m_written{ 0 }, m_failed{ 0 };
+		bool m_running = false;
+
+		std::vector<std::thread> m_workers;
+		std::vector<Frame*> m_queue;
+		//The readback buffers the workers are done with, to unmap on the main thread
+		std::vector<unsigned int> m_copied;
+		std::mutex m_mutex;
+		std::condition_variable m_condition;
+
+		//Called by the readback ring with the pixels of a captured frame. The pixels stay mapped for a worker to copy, the game thread only queues them.
+		static void Receive(unsigned char* pixels, Size size, void* userdata)
+		{
+			FrameRecorder* recorder = (FrameRecorder*)userdata;
+			std::lock_guard<std::mutex> lock(recorder->m_mutex);
+			if (recorder->m_queue.size() >= recorder->m_queuesize)
+			{
+				recorder->m_dropped++;
+				return;
+			}
+
+			Frame* frame = new Frame();
+			frame->index = recorder->m_received++;
+			frame->size = size;
+			frame->pbo = Readbacks::rr->Keep();
+			frame->mapped = pixels;
+			recorder->m_queue.push_back(frame);
+			recorder->m_condition.notify_one();
+		}
+
+		//Gives the buffers the workers copied back to the readback ring.
+		void ReleaseBuffers()
 		{
-			element->Render(this);
+			std::vector<unsigned int> copied;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				copied.swap(m_copied);
+			}
+			if (Readbacks::rr)
+				for (unsigned int pbo : copied)
+					Readbacks::rr->Release(pbo);
 		}
 
-		inline ~Renderer() {
-			if (m_frame != 0)
-				glDeleteFramebuffers(1, &m_frame);
-			if (m_tex != 0)
-				glDeleteTextures(1, &m_tex);
-			if (m_vao)
-			{ 
-				glDeleteVertexArrays(1, &m_vao);
-				glDeleteBuffers(1, &m_vbo);
-				glDeleteBuffers(1, &m_tbo);
+		void Work()
+		{
+			while (true)
+			{
+				Frame* frame;
+				{
+					std::unique_lock<std::mutex> lock(m_mutex);
+					m_condition.wait(lock, [this]() { return !m_queue.empty() || !m_running; });
+					if (m_queue.empty())
+						return;
+					frame = m_queue.front();
+					m_queue.erase(m_queue.begin());
+				}
+
+				//The rows come bottom first. The buffer goes back as soon as it is copied
+				Size size = frame->size;
+				frame->pixels.resize(size.width * size.height * 4);
+				for (unsigned int y = 0; y < size.height; y++)
+					memcpy(&frame->pixels[y * size.width * 4], frame->mapped + (size.height - 1 - y) * size.width * 4, size.width * 4);
+				{
+					std::lock_guard<std::mutex> lock(m_mutex);
+					m_copied.push_back(frame->pbo);
+				}
+
+				if (Write(frame))
+					m_written++;
+				else
+					m_failed++;
+				delete frame;
 			}
 		}
 
-	private:
-		unsigned int m_frame, m_tex, m_width, m_height, m_vao, m_vbo, m_tbo;
-		static unsigned int m_bound;
-		static Renderer* s_wind;
+		bool Write(Frame* frame)
+		{
+			std::wstring number = std::to_wstring(frame->index);
+			number = std::wstring(number.size() < 6 ? 6 - number.size() : 0, L'0') + number;
+			std::wstring path = m_directory + L"/frame_" + number;
 
-		inline void Bind()
-		{		
-			Bindings::BindFramebuffer(m_frame, m_width, m_height);
+			switch (m_format)
+			{
+			case PNGSequence:
+			{
+				//Encoded in memory, stb only opens narrow paths
+				std::vector<unsigned char> png;
+				stbi_write_png_to_func([](void* context, void* data, int size)
+				{
+					std::vector<unsigned char>* out = (std::vector<unsigned char>*)context;
+					out->insert(out->end(), (unsigned char*)data, (unsigned char*)data + size);
+				}, &png, frame->size.width, frame->size.height, 4, frame->pixels.data(), 0);
+				return !png.empty() && WriteFile(path + L".png", png.data(), png.size());
+			}
+			case QOISequence:
+			{
+				std::vector<unsigned char> qoi = EncodeQOI(frame->pixels.data(), frame->size);
+				return WriteFile(path + L".qoi", qoi.data(), qoi.size());
+			}
+			default:
+				return WriteFile(path + L".rgba", frame->pixels.data(), frame->pixels.size());
+			}
 		}
 
-		inline void BindForRendering()
+		static bool WriteFile(std::wstring path, unsigned char* data, size_t size)
 		{
-			Bindings::BindTexture(m_tex);
-			Bindings::BindVAO(m_vao);
+			FILE* file = _wfopen(path.c_str(), L"wb");
+			if (!file)
+				return false;
+			bool ok = fwrite(data, 1, size, file) == size;
+			fclose(file);
+			return ok;
+		}
+
+		//Encodes RGBA pixels in the Quite OK Image format. It compresses about as well as PNG but many times faster.
+		static std::vector<unsigned char> EncodeQOI(const unsigned char* pixels, Size size)
+		{
+			std::vector<unsigned char> out = { 'q', 'o', 'i', 'f' };
+			for (unsigned int value : { size.width, size.height })
+				for (int shift = 24; shift >= 0; shift -= 8)
+					out.push_back((value >> shift) & 0xff);
+			out.push_back(4);
+			out.push_back(0);
+			out.reserve(size.width * size.height + 32);
+
+			unsigned char index[64 * 4] = { 0 };
+			unsigned char prev[4] = { 0, 0, 0, 255 };
+			unsigned int run = 0, count = size.width * size.height;
+			for (unsigned int i = 0; i < count; i++)
+			{
+				const unsigned char* px = pixels + i * 4;
+				if (!memcmp(px, prev, 4))
+				{
+					run++;
+					if (run == 62 || i == count - 1)
+					{
+						out.push_back(0xc0 | (run - 1));
+						run = 0;
+					}
+					continue;
+				}
+				if (run)
+				{
+					out.push_back(0xc0 | (run - 1));
+					run = 0;
+				}
+
+				unsigned int slot = (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+				if (!memcmp(index + slot * 4, px, 4))
+					out.push_back(slot);
+				else
+				{
+					memcpy(index + slot * 4, px, 4);
+					if (px[3] == prev[3])
+					{
+						signed char vr = px[0] - prev[0], vg = px[1] - prev[1], vb = px[2] - prev[2];
+						signed char vgr = vr - vg, vgb = vb - vg;
+						if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2)
+							out.push_back(0x40 | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+						else if (vgr > -9 && vgr < 8 && vg > -33 && vg < 32 && vgb > -9 && vgb < 8)
+						{
+							out.push_back(0x80 | (vg + 32));
+							out.push_back((vgr + 8) << 4 | (vgb + 8));
+						}
+						else
+							out.insert(out.end(), { 0xfe, px[0], px[1], px[2] });
+					}
+					else
+						out.insert(out.end(), { 0xff, px[0], px[1], px[2], px[3] });
+				}
+				memcpy(prev, px, 4);
+			}
+			out.insert(out.end(), { 0, 0, 0, 0, 0, 0, 0, 1 });
+			return out;
 		}
 	};
-	unsigned int Renderer::m_bound;
-	Renderer* Renderer::s_wind;
-	
+
 	class Window
 	{
 	public:
@@ -3713,44 +8176,8 @@ return T();
 			if (!m_window)
 				return NULL;
 
-			if (!m_initialized)
-			{
-				if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
-				{ 
-					ThrowException(L"GL version not supported");
-					return NULL;
-				}
-				m_initialized = true;
-				
-				Shaders::ts = new TextureShader();
-				
-				glEnable(GL_TEXTURE_2D);
-				glEnable(GL_BLEND);
-				glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-				Shaders::ts->CreateUpLayer();
-
-				m_renderer = new Renderer(Size(m_width, m_height), true);
-			}
-
-			int maj, min;
-			glGetIntegerv(GL_MAJOR_VERSION, &maj);
-			glGetIntegerv(GL_MINOR_VERSION, &min);
-			if (maj < version.Major)
-			{
-				ThrowException(std::wstring(L"Your GPU does not support OpenGL ") + std::to_wstring(version.Major) + L" " + std::to_wstring(version.Minor));
+			if (!Initialize(version))
 				return NULL;
-			}
-			else
-			{
-				if (maj == version.Major)
-				{
-					if (min < version.Minor)
-					{
-						ThrowException(std::wstring(L"Your GPU does not support OpenGL ") + std::to_wstring(version.Major) + L" " + std::to_wstring(version.Minor));
-						return NULL;
-					}
-				}
-			}
 
 			mainwindow = this;
 
@@ -3762,6 +8189,40 @@ return T();
 			return m_renderer;
 		}
 
+		//Creates an OpenGL context without showing a window, for programs that run where there is no display. The returned renderer draws into a framebuffer of the window size, use GetContent() to read it.
+		//Set egl to create the context with EGL instead of GLX or WGL. GLFW still needs a display for the hidden window: on Linux that is an X server, Xvfb works, and on Windows egl needs libEGL next to the program. This should only be executed once in your program instead of Create(). Don´t delete the renderer.
+		Renderer* CreateHeadless(GLVersion version = GLVersion(3, 0), bool egl = false)
+		{
+			glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, version.Major);
+			glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, version.Minor);
+			glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+			if (egl)
+				glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_EGL_CONTEXT_API);
+
+			//The window is only there to own the context, the renderer has its own framebuffer
+			m_window = glfwCreateWindow(1, 1, StringTools::ToString(m_title).c_str(), NULL, NULL);
+			glfwDefaultWindowHints();
+			if (!m_window)
+			{
+				ThrowException(L"Unable to create a headless OpenGL context");
+				return NULL;
+			}
+			glfwMakeContextCurrent(m_window);
+
+			m_headless = true;
+			if (!Initialize(version))
+				return NULL;
+
+			mainwindow = this;
+			return m_renderer;
+		}
+
+		//Checks if the window was created with CreateHeadless().
+		inline bool IsHeadless()
+		{
+			return m_headless;
+		}
+
 		//Returns if the window is open.
 		inline bool IsOpen() { if (m_window) return !glfwWindowShouldClose(m_window); else ThrowException(L"Window hasn't been created yet"); return false; }
 		
@@ -3785,7 +8246,8 @@ return T();
 
 		//Swaps the old frame for the new one you rendered. Call this every frame.		
 		inline void SwapBuffers() {
-			if (m_window) { glfwSwapBuffers(m_window);  glClear(GL_COLOR_BUFFER_BIT); }
+			if (m_headless) { Bindings::FlushBatch(); Readbacks::rr->Update(); }
+			else if (m_window) { Bindings::FlushBatch(); Readbacks::rr->Update(); glfwSwapBuffers(m_window);  glClear(GL_COLOR_BUFFER_BIT); }
 			else ThrowException(L"Window hasn't been created yet");
 		}
 		//Gets the size of the window.
@@ -3915,8 +8377,66 @@ return T();
 		bool m_vsync;
 		GLFWimage* icon;
 		Renderer* m_renderer;
+		bool m_headless = false;
 		static Window* mainwindow;
 
+		//Loads OpenGL and creates the shaders and the renderer.
+		bool Initialize(GLVersion version)
+		{
+			if (!m_initialized)
+			{
+				if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
+				{ 
+					ThrowException(L"GL version not supported");
+					return false;
+				}
+				m_initialized = true;
+				Bindings::s_context = true;
+				
+				Shaders::ts = new TextureShader();
+				
+				glEnable(GL_TEXTURE_2D);
+				glEnable(GL_BLEND);
+				glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+				Shaders::ts->CreateUpLayer();
+				Shaders::tm = new TileMapShader();
+				Shaders::tm->CreateUpLayer();
+				Instancing::Load();
+				if (Instancing::IsSupported())
+				{
+					Shaders::is = new InstanceShader();
+					Shaders::is->CreateUpLayer();
+					Batching::ib = new InstanceBatch();
+				}
+				Shaders::ts->Use();
+				Batching::sb = new SpriteBatch();
+				Readbacks::rr = new ReadbackRing();
+
+				m_renderer = new Renderer(Size(m_width, m_height), !m_headless);
+			}
+
+			int maj, min;
+			glGetIntegerv(GL_MAJOR_VERSION, &maj);
+			glGetIntegerv(GL_MINOR_VERSION, &min);
+			if (maj < (int)version.Major)
+			{
+				ThrowException(std::wstring(L"Your GPU does not support OpenGL ") + std::to_wstring(version.Major) + L" " + std::to_wstring(version.Minor));
+				return false;
+			}
+			else
+			{
+				if (maj == (int)version.Major)
+				{
+					if (min < (int)version.Minor)
+					{
+						ThrowException(std::wstring(L"Your GPU does not support OpenGL ") + std::to_wstring(version.Major) + L" " + std::to_wstring(version.Minor));
+						return false;
+					}
+				}
+			}
+			return true;
+		}
+
 		inline static void GLFWresize(GLFWwindow* window, int width, int height)
 		{
 			mainwindow->IncompleteResize(width, height);
@@ -3924,6 +8444,7 @@ return T();
 
 		void IncompleteResize(int width, int height)
 		{
+			Bindings::FlushBatch();
 			m_width = width;
 			m_height = height;
 			Renderer::UpdateWindowFramebuffer(Size(width, height));
@@ -5073,7 +9594,24 @@ return T();
 	{
 		AudioFramework::Finalize();
 		Input::KeyBind::Clean();
+		TerrainMesh::Clean();
+		TerrainTileMap::Clean();
+		Bindings::FlushBatch();
+		if (Readbacks::rr)
+			Readbacks::rr->Finish();
+		delete Readbacks::rr;
+		Readbacks::rr = NULL;
+		//The camera of the queue flushes it when deleted
+		RenderQueue* rq = Queueing::rq;
+		Queueing::rq = NULL;
+		delete rq;
+		delete Batching::sb;
+		Batching::sb = NULL;
+		delete Batching::ib;
+		Batching::ib = NULL;
 		delete Shaders::ts;
+		delete Shaders::tm;
+		delete Shaders::is;
 		glfwTerminate();
 	}
 }
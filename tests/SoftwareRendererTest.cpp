@@ -0,0 +1,110 @@
+//Golden image tests of the SoftwareRenderer. Every scene is drawn without a window and compared pixel by pixel with tests/golden/<scene>.png.
+//Run it from the root of the repository. Pass --update to write the golden images again after a change that is meant to change the output, and look at them before committing.
+#include "../include/GizegoEngine.h"
+
+using namespace GizegoEngine;
+
+void ExceptionHandler(std::wstring str, ExceptionGravity gravity)
+{
+	std::wcerr << str << std::endl;
+}
+
+//A checkerboard with a transparent column, so scaling, mirroring and blending all show up in the output
+Image* CreateChecker()
+{
+	Image* img = new Image(Size(8, 8));
+	for (int y = 0; y < 8; y++)
+		for (int x = 0; x < 8; x++)
+			img->SetPixel(vec2(x, y), x == 7 ? Color(255, 255, 255, 0) : (x + y) % 2 ? Color(230, 60, 20, 255) : Color(20, 90, 240, 160));
+	return img;
+}
+
+//Quads that cross the squares the renderer splits the output in, scaled, mirrored and blended over each other
+Image* DrawQuads()
+{
+	SoftwareRenderer renderer(Size(150, 100));
+	Image* checker = CreateChecker();
+	renderer.Fill(Color(30, 40, 50));
+	renderer.Render(checker, vec2(5, 7), vecf(3, 3));
+	renderer.Render(checker, vec2(58, 30), vecf(8.5f, 4.25f), Color(255, 255, 255, 200));
+	renderer.Render(checker, vec2(140, 90), vecf(-5, -2));
+	renderer.Fill(Color(255, 200, 0, 40));
+	Image* content = renderer.GetContent();
+	delete checker;
+	return content;
+}
+
+//Filled meshes and lines, with negative and fractional scales
+Image* DrawMeshes()
+{
+	SoftwareRenderer renderer(Size(130, 130));
+	GeometryMesh hexagon(6, 20);
+	GeometryMesh lines({ 0, 0, 60, 10, 10, 0, 40, 60, -5, 20, 30, -20 });
+	renderer.Fill(Color(0, 0, 0));
+	renderer.Render(&hexagon, Color(40, 200, 90), GeometryRenderingMode::FillTriangles, vec2(40, 40), vecf(1.5f, -1));
+	renderer.Render(&hexagon, Color(200, 40, 90, 128), GeometryRenderingMode::FillTriangles, vec2(70, 80), vecf(2.25f, 1.75f));
+	renderer.Render(&lines, Color(255, 255, 255), GeometryRenderingMode::Lines, vec2(60, 50), vecf(1, 1));
+	renderer.Render(&lines, Color(255, 255, 0, 180), GeometryRenderingMode::Lines, vec2(120, 120), vecf(-1.5f, -1.5f));
+	return renderer.GetContent();
+}
+
+//An image and a mesh deleted before the content is retrieved are drawn when they are deleted
+Image* DrawDeleted()
+{
+	SoftwareRenderer renderer(Size(100, 100));
+	Image* checker = CreateChecker();
+	GeometryMesh* hexagon = new GeometryMesh(6, 20);
+	renderer.Fill(Color(60, 60, 60));
+	renderer.Render(checker, vec2(10, 10), vecf(6, 6));
+	renderer.Render(hexagon, Color(40, 200, 90, 200), GeometryRenderingMode::FillTriangles, vec2(50, 50));
+	delete checker;
+	delete hexagon;
+	return renderer.GetContent();
+}
+
+//Draws a scene and compares it with its golden image, or saves it when updating. Returns false if they differ.
+bool Check(std::wstring name, Image* (*draw)(), bool update)
+{
+	std::wstring path = L"tests/golden/" + name + L".png";
+	Image* content = draw();
+	bool ok = true;
+	if (update)
+	{
+		content->Save(path, ImageFormat::PNG, 100);
+		std::wcout << L"updated " << path << std::endl;
+	}
+	else
+	{
+		Image golden(path);
+		if (!golden.GetData() || golden.GetWidth() != content->GetWidth() || golden.GetHeight() != content->GetHeight())
+			ok = false;
+		else
+		{
+			unsigned int wrong = 0;
+			for (unsigned int i = 0; i < content->GetWidth() * content->GetHeight() * 4; i++)
+				if (golden.GetData()[i] != content->GetData()[i])
+					wrong++;
+			ok = wrong == 0;
+			if (!ok)
+			{
+				content->Save(L"tests/golden/" + name + L".failed.png", ImageFormat::PNG, 100);
+				std::wcout << wrong << L" channels differ, the output is in tests/golden/" << name << L".failed.png" << std::endl;
+			}
+		}
+		std::wcout << (ok ? L"passed " : L"FAILED ") << name << std::endl;
+	}
+	delete content;
+	return ok;
+}
+
+int main(int argc, char** argv)
+{
+	SetExceptionHandler(ExceptionHandler);
+	bool update = argc > 1 && std::string(argv[1]) == "--update";
+
+	int failed = 0;
+	failed += !Check(L"quads", DrawQuads, update);
+	failed += !Check(L"meshes", DrawMeshes, update);
+	failed += !Check(L"deleted", DrawDeleted, update);
+	return failed;
+}